@@ -0,0 +1,278 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "libmq.h"
+
+/* Compression of messages
+ *
+ * The contexts of the codecs are created once, with the dictionary,
+ * and reset for each message. Decompression contexts are created on
+ * the first message of their codec, as a receiver decodes whatever
+ * codec the senders use.
+ */
+struct mqu_codec {
+	int codec; /* used to compress */
+	int level;
+	uint8_t *dict;
+	size_t dict_len;
+#ifdef HAVE_LZ4
+	void *lz4_state;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *zstd_cctx;
+	ZSTD_CDict *zstd_cdict;
+	ZSTD_DCtx *zstd_dctx;
+	ZSTD_DDict *zstd_ddict;
+#endif
+#ifdef HAVE_ZLIB
+	z_stream deflate;
+	z_stream inflate;
+	int deflate_ready;
+	int inflate_ready;
+#endif
+};
+
+int mqu_codec_available(int codec)
+{
+	switch (codec) {
+	case MQU_CODEC_NONE: return 1;
+#ifdef HAVE_LZ4
+	case MQU_CODEC_LZ4: return 1;
+#endif
+#ifdef HAVE_ZSTD
+	case MQU_CODEC_ZSTD: return 1;
+#endif
+#ifdef HAVE_ZLIB
+	case MQU_CODEC_ZLIB: return 1;
+#endif
+	default: return 0;
+	}
+}
+
+struct mqu_codec *mqu_codec_new(int codec, int level, const void *dict, size_t dict_len)
+{
+	struct mqu_codec *c;
+
+	if (!mqu_codec_available(codec) || (dict_len && MQU_CODEC_LZ4 == codec)) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	c = calloc(1, sizeof(*c));
+	if (!c) return NULL;
+	c->codec = codec;
+	c->level = level;
+	if (dict_len) {
+		c->dict = malloc(dict_len);
+		if (!c->dict) goto error;
+		memcpy(c->dict, dict, dict_len);
+		c->dict_len = dict_len;
+	}
+
+	switch (codec) {
+#ifdef HAVE_LZ4
+	case MQU_CODEC_LZ4:
+		c->lz4_state = malloc(LZ4_sizeofState());
+		if (!c->lz4_state) goto error;
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case MQU_CODEC_ZSTD:
+		c->zstd_cctx = ZSTD_createCCtx();
+		if (!c->zstd_cctx) goto error;
+		if (c->dict_len) {
+			c->zstd_cdict = ZSTD_createCDict(c->dict, c->dict_len, level ? level : ZSTD_CLEVEL_DEFAULT);
+			if (!c->zstd_cdict) goto error;
+		}
+		break;
+#endif
+#ifdef HAVE_ZLIB
+	case MQU_CODEC_ZLIB:
+		/* raw deflate: the header byte of the message replaces the zlib header */
+		if (Z_OK != deflateInit2(&c->deflate, level ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+		                         Z_DEFAULT_STRATEGY)) {
+			goto error;
+		}
+		c->deflate_ready = 1;
+		break;
+#endif
+	default:
+		break;
+	}
+	return c;
+
+error:
+	mqu_codec_free(c);
+	errno = ENOMEM;
+	return NULL;
+}
+
+void mqu_codec_free(struct mqu_codec *c)
+{
+	if (!c) return;
+#ifdef HAVE_LZ4
+	free(c->lz4_state);
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx(c->zstd_cctx);
+	ZSTD_freeCDict(c->zstd_cdict);
+	ZSTD_freeDCtx(c->zstd_dctx);
+	ZSTD_freeDDict(c->zstd_ddict);
+#endif
+#ifdef HAVE_ZLIB
+	if (c->deflate_ready) deflateEnd(&c->deflate);
+	if (c->inflate_ready) inflateEnd(&c->inflate);
+#endif
+	free(c->dict);
+	free(c);
+}
+
+/* Compress into out, return the compressed size, or 0 if it does not fit */
+static size_t mqu_codec_compress(struct mqu_codec *c, const uint8_t *data, size_t len, uint8_t *out, size_t size)
+{
+	switch (c->codec) {
+#ifdef HAVE_LZ4
+	case MQU_CODEC_LZ4: {
+		int n = LZ4_compress_fast_extState(c->lz4_state, (const char *)data, (char *)out, len, size,
+		                                   c->level > 0 ? c->level : 1);
+		return n > 0 ? (size_t)n : 0;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case MQU_CODEC_ZSTD: {
+		size_t n;
+		if (c->zstd_cdict) n = ZSTD_compress_usingCDict(c->zstd_cctx, out, size, data, len, c->zstd_cdict);
+		else n = ZSTD_compressCCtx(c->zstd_cctx, out, size, data, len, c->level ? c->level : ZSTD_CLEVEL_DEFAULT);
+		return ZSTD_isError(n) ? 0 : n;
+	}
+#endif
+#ifdef HAVE_ZLIB
+	case MQU_CODEC_ZLIB: {
+		z_stream *z = &c->deflate;
+		if (Z_OK != deflateReset(z)) return 0;
+		if (c->dict_len && Z_OK != deflateSetDictionary(z, c->dict, c->dict_len)) return 0;
+		z->next_in = (Bytef *)data;
+		z->avail_in = len;
+		z->next_out = out;
+		z->avail_out = size;
+		if (Z_STREAM_END != deflate(z, Z_FINISH)) return 0;
+		return size - z->avail_out;
+	}
+#endif
+	default:
+		(void)data;
+		(void)len;
+		(void)out;
+		(void)size;
+		return 0;
+	}
+}
+
+/* Decompress into out, return the decompressed size, or -1 if invalid */
+static ssize_t mqu_codec_decompress(struct mqu_codec *c, int codec, const uint8_t *data, size_t len,
+                                    uint8_t *out, size_t size)
+{
+	switch (codec) {
+#ifdef HAVE_LZ4
+	case MQU_CODEC_LZ4: {
+		int n = LZ4_decompress_safe((const char *)data, (char *)out, len, size);
+		return n >= 0 ? n : -1;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case MQU_CODEC_ZSTD: {
+		size_t n;
+		if (!c->zstd_dctx && !(c->zstd_dctx = ZSTD_createDCtx())) return -1;
+		if (c->dict_len && !c->zstd_ddict && !(c->zstd_ddict = ZSTD_createDDict(c->dict, c->dict_len))) return -1;
+		if (c->zstd_ddict) n = ZSTD_decompress_usingDDict(c->zstd_dctx, out, size, data, len, c->zstd_ddict);
+		else n = ZSTD_decompressDCtx(c->zstd_dctx, out, size, data, len);
+		return ZSTD_isError(n) ? -1 : (ssize_t)n;
+	}
+#endif
+#ifdef HAVE_ZLIB
+	case MQU_CODEC_ZLIB: {
+		z_stream *z = &c->inflate;
+		if (!c->inflate_ready) {
+			if (Z_OK != inflateInit2(z, -15)) return -1;
+			c->inflate_ready = 1;
+		} else if (Z_OK != inflateReset(z)) {
+			return -1;
+		}
+		if (c->dict_len && Z_OK != inflateSetDictionary(z, c->dict, c->dict_len)) return -1;
+		z->next_in = (Bytef *)data;
+		z->avail_in = len;
+		z->next_out = out;
+		z->avail_out = size;
+		if (Z_STREAM_END != inflate(z, Z_FINISH)) return -1;
+		return size - z->avail_out;
+	}
+#endif
+	default:
+		(void)c;
+		(void)data;
+		(void)len;
+		(void)out;
+		(void)size;
+		return -1;
+	}
+}
+
+size_t mqu_compress(struct mqu_codec *c, const void *data, size_t len, void *out, const void **result)
+{
+	const uint8_t *in = data;
+	uint8_t *header = out;
+
+	/* only compress when it saves at least a byte, header included */
+	if (len > 2 && MQU_CODEC_NONE != c->codec) {
+		size_t n = mqu_codec_compress(c, in, len, header + 1, len - 2);
+		if (n) {
+			header[0] = MQU_CODEC_BASE + c->codec;
+			*result = out;
+			return n + 1;
+		}
+	}
+
+	if (len && in[0] >= MQU_CODEC_BASE) {
+		header[0] = MQU_CODEC_BASE + MQU_CODEC_NONE;
+		memcpy(header + 1, in, len);
+		*result = out;
+		return len + 1;
+	}
+	*result = data;
+	return len;
+}
+
+size_t mqu_decompress(struct mqu_codec *c, const void *data, size_t len, void *out, size_t size,
+                      const void **result)
+{
+	const uint8_t *in = data;
+
+	*result = data;
+	if (0 == len || in[0] < MQU_CODEC_BASE || in[0] >= MQU_CODEC_BASE + MQU_CODECS) return len;
+	if (MQU_CODEC_BASE + MQU_CODEC_NONE == in[0]) {
+		*result = in + 1;
+		return len - 1;
+	}
+
+	ssize_t n = mqu_codec_decompress(c, in[0] - MQU_CODEC_BASE, in + 1, len - 1, out, size);
+	if (n < 0) {
+		errno = EBADMSG;
+		return (size_t)-1;
+	}
+	*result = out;
+	return n;
+}
@@ -0,0 +1,550 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "libmq.h"
+
+static int mqu_hist_index(uint64_t value)
+{
+	if (value < MQU_HIST_SUB) return value;
+	int exponent = 63 - __builtin_clzll(value);
+	int shift = exponent - MQU_HIST_SUB_BITS;
+	return (shift + 1) * MQU_HIST_SUB + ((value >> shift) & (MQU_HIST_SUB - 1));
+}
+
+/* Highest value stored in the bucket */
+static uint64_t mqu_hist_value(int index)
+{
+	if (index < MQU_HIST_SUB) return index;
+	int shift = index / MQU_HIST_SUB - 1;
+	uint64_t lower = (uint64_t)(MQU_HIST_SUB + index % MQU_HIST_SUB) << shift;
+	return lower + ((uint64_t)1 << shift) - 1;
+}
+
+void mqu_hist_add(struct mqu_histogram *hist, uint64_t value)
+{
+	hist->buckets[mqu_hist_index(value)]++;
+	hist->count++;
+	if (value > hist->max) hist->max = value;
+}
+
+void mqu_hist_merge(struct mqu_histogram *hist, const struct mqu_histogram *other)
+{
+	for (int i=0; i<MQU_HIST_BUCKETS; i++) hist->buckets[i] += other->buckets[i];
+	hist->count += other->count;
+	if (other->max > hist->max) hist->max = other->max;
+}
+
+uint64_t mqu_hist_percentile(const struct mqu_histogram *hist, double percent)
+{
+	uint64_t rank = (uint64_t)(hist->count * percent / 100.0);
+	uint64_t seen = 0;
+
+	if (rank >= hist->count) return hist->max;
+	for (int i=0; i<MQU_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen > rank) {
+			uint64_t value = mqu_hist_value(i);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+uint64_t mqu_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void mqu_deadline(struct timespec *deadline, int64_t timeout)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += timeout / 1000000000;
+	deadline->tv_nsec += timeout % 1000000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/* Statistics, updated without locks and reported by a separate thread */
+struct mqu_stats_hist {
+	atomic_ullong count;
+	atomic_ullong sum;
+	atomic_ullong max;
+	atomic_ullong buckets[MQU_HIST_BUCKETS];
+};
+
+struct mqu_stats_op {
+	atomic_ullong messages;
+	atomic_ullong bytes;
+	atomic_ullong max_bytes;
+	atomic_ullong eagain;
+	atomic_ullong etimedout;
+	atomic_ullong errors;
+	atomic_ullong priorities[MQU_STATS_PRIOS];
+	struct mqu_stats_hist time; /* nanoseconds per call */
+};
+
+struct mqu_stats {
+	struct mqu_stats_op ops[MQU_STATS_OPS];
+	struct mqu_stats_hist poll; /* nanoseconds blocked waiting for messages */
+	uint64_t start;
+	FILE *out;
+	double interval; /* seconds between reports, 0 to report at exit only */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stop;
+};
+
+static const char *mqu_stats_op_names[MQU_STATS_OPS] = { "send", "recv" };
+
+static void mqu_stats_hist_add(struct mqu_stats_hist *hist, uint64_t value)
+{
+	atomic_fetch_add_explicit(&hist->buckets[mqu_hist_index(value)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->sum, value, memory_order_relaxed);
+	unsigned long long max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+	while (value > max && !atomic_compare_exchange_weak_explicit(&hist->max, &max, value,
+	                                                             memory_order_relaxed, memory_order_relaxed));
+}
+
+uint64_t mqu_stats_start(const struct mqu_stats *stats)
+{
+	return stats ? mqu_now_ns() : 0;
+}
+
+void mqu_stats_record(struct mqu_stats *stats, int op, uint64_t start, ssize_t result, unsigned prio)
+{
+	int saved_errno = errno;
+	if (!stats) return;
+
+	struct mqu_stats_op *s = &stats->ops[op];
+	mqu_stats_hist_add(&s->time, mqu_now_ns() - start);
+	if (result >= 0) {
+		atomic_fetch_add_explicit(&s->messages, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&s->bytes, result, memory_order_relaxed);
+		unsigned long long max = atomic_load_explicit(&s->max_bytes, memory_order_relaxed);
+		while ((unsigned long long)result > max
+		       && !atomic_compare_exchange_weak_explicit(&s->max_bytes, &max, result,
+		                                                 memory_order_relaxed, memory_order_relaxed));
+		if (prio >= MQU_STATS_PRIOS) prio = MQU_STATS_PRIOS - 1;
+		atomic_fetch_add_explicit(&s->priorities[prio], 1, memory_order_relaxed);
+	} else if (EAGAIN == saved_errno) {
+		atomic_fetch_add_explicit(&s->eagain, 1, memory_order_relaxed);
+	} else if (ETIMEDOUT == saved_errno) {
+		atomic_fetch_add_explicit(&s->etimedout, 1, memory_order_relaxed);
+	} else {
+		atomic_fetch_add_explicit(&s->errors, 1, memory_order_relaxed);
+	}
+	errno = saved_errno;
+}
+
+void mqu_stats_wait(struct mqu_stats *stats, uint64_t start)
+{
+	if (stats) mqu_stats_hist_add(&stats->poll, mqu_now_ns() - start);
+}
+
+static void mqu_stats_load_times(struct mqu_stats_times *times, struct mqu_stats_hist *atomic_hist)
+{
+	struct mqu_histogram hist;
+
+	hist.count = atomic_load(&atomic_hist->count);
+	hist.max = atomic_load(&atomic_hist->max);
+	for (int i=0; i<MQU_HIST_BUCKETS; i++) hist.buckets[i] = atomic_load(&atomic_hist->buckets[i]);
+
+	times->count = hist.count;
+	times->total_ns = atomic_load(&atomic_hist->sum);
+	times->p50_ns = mqu_hist_percentile(&hist, 50);
+	times->p99_ns = mqu_hist_percentile(&hist, 99);
+	times->p999_ns = mqu_hist_percentile(&hist, 99.9);
+	times->max_ns = hist.max;
+}
+
+void mqu_stats_snapshot(struct mqu_stats *stats, struct mqu_stats_snapshot *snapshot)
+{
+	snapshot->elapsed = (mqu_now_ns() - stats->start) / 1e9;
+	for (int op=0; op<MQU_STATS_OPS; op++) {
+		struct mqu_stats_op *s = &stats->ops[op];
+		struct mqu_stats_counts *counts = &snapshot->ops[op];
+		counts->messages = atomic_load(&s->messages);
+		counts->bytes = atomic_load(&s->bytes);
+		counts->max_bytes = atomic_load(&s->max_bytes);
+		counts->eagain = atomic_load(&s->eagain);
+		counts->etimedout = atomic_load(&s->etimedout);
+		counts->errors = atomic_load(&s->errors);
+		for (int prio=0; prio<MQU_STATS_PRIOS; prio++) counts->priorities[prio] = atomic_load(&s->priorities[prio]);
+		mqu_stats_load_times(&counts->time, &s->time);
+	}
+	mqu_stats_load_times(&snapshot->wait, &stats->poll);
+}
+
+static void mqu_stats_print_times(FILE *out, const char *name, const struct mqu_stats_times *times)
+{
+	fprintf(out, "\"%s\":{\"count\":%llu,\"total_ns\":%llu,\"p50_ns\":%llu,"
+	        "\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+	        name, (unsigned long long)times->count, (unsigned long long)times->total_ns,
+	        (unsigned long long)times->p50_ns, (unsigned long long)times->p99_ns,
+	        (unsigned long long)times->p999_ns, (unsigned long long)times->max_ns);
+}
+
+void mqu_stats_report(struct mqu_stats *stats)
+{
+	FILE *out = stats->out;
+	struct mqu_stats_snapshot snapshot;
+	struct timespec now;
+
+	if (!out) return;
+	mqu_stats_snapshot(stats, &snapshot);
+	clock_gettime(CLOCK_REALTIME, &now);
+	fprintf(out, "{\"time\":%ld.%03ld,\"elapsed\":%.3f", (long)now.tv_sec, now.tv_nsec / 1000000,
+	        snapshot.elapsed);
+
+	for (int op=0; op<MQU_STATS_OPS; op++) {
+		const struct mqu_stats_counts *counts = &snapshot.ops[op];
+		if (0 == counts->time.count) continue;
+
+		fprintf(out, ",\"%s\":{\"messages\":%llu,\"bytes\":%llu,\"max_bytes\":%llu,\"eagain\":%llu,"
+		        "\"etimedout\":%llu,\"errors\":%llu,",
+		        mqu_stats_op_names[op], (unsigned long long)counts->messages,
+		        (unsigned long long)counts->bytes, (unsigned long long)counts->max_bytes,
+		        (unsigned long long)counts->eagain,
+		        (unsigned long long)counts->etimedout, (unsigned long long)counts->errors);
+		mqu_stats_print_times(out, "time", &counts->time);
+		fprintf(out, ",\"priorities\":{");
+		const char *sep = "";
+		for (int prio=0; prio<MQU_STATS_PRIOS; prio++) {
+			if (!counts->priorities[prio]) continue;
+			fprintf(out, "%s\"%d\":%llu", sep, prio, (unsigned long long)counts->priorities[prio]);
+			sep = ",";
+		}
+		fprintf(out, "}}");
+	}
+	if (snapshot.wait.count) {
+		fprintf(out, ",");
+		mqu_stats_print_times(out, "wait", &snapshot.wait);
+	}
+	fprintf(out, "}\n");
+	fflush(out);
+}
+
+static void *mqu_stats_reporter(void *arg)
+{
+	struct mqu_stats *stats = arg;
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	pthread_mutex_lock(&stats->mutex);
+	while (!stats->stop) {
+		uint64_t ns = deadline.tv_nsec + (uint64_t)(stats->interval * 1e9);
+		deadline.tv_sec += ns / 1000000000;
+		deadline.tv_nsec = ns % 1000000000;
+		while (!stats->stop && ETIMEDOUT != pthread_cond_timedwait(&stats->cond, &stats->mutex, &deadline));
+		if (!stats->stop) mqu_stats_report(stats);
+	}
+	pthread_mutex_unlock(&stats->mutex);
+	return NULL;
+}
+
+struct mqu_stats *mqu_stats_new(FILE *out, double interval)
+{
+	struct mqu_stats *stats = calloc(1, sizeof(*stats));
+	if (!stats) return NULL;
+
+	stats->start = mqu_now_ns();
+	stats->out = out;
+	stats->interval = interval;
+	pthread_mutex_init(&stats->mutex, NULL);
+	pthread_cond_init(&stats->cond, NULL);
+	/* without a thread, the statistics are only reported at the end */
+	if (!out || interval <= 0 || 0 != pthread_create(&stats->thread, NULL, mqu_stats_reporter, stats)) {
+		stats->interval = 0;
+	}
+	return stats;
+}
+
+void mqu_stats_free(struct mqu_stats *stats)
+{
+	if (stats->interval > 0) {
+		pthread_mutex_lock(&stats->mutex);
+		stats->stop = 1;
+		pthread_cond_signal(&stats->cond);
+		pthread_mutex_unlock(&stats->mutex);
+		pthread_join(stats->thread, NULL);
+	}
+	mqu_stats_report(stats);
+	pthread_cond_destroy(&stats->cond);
+	pthread_mutex_destroy(&stats->mutex);
+	free(stats);
+}
+
+static size_t mqu_put_varint(uint8_t *out, uint64_t value)
+{
+	size_t n = 0;
+	while (value >= 0x80) {
+		out[n++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	out[n++] = value;
+	return n;
+}
+
+/* Return the number of bytes used, 0 if incomplete, -1 if invalid */
+static int mqu_get_varint(const uint8_t *in, size_t avail, int maxbytes, uint64_t *value)
+{
+	*value = 0;
+	for (int i=0; i<maxbytes; i++) {
+		if ((size_t)i >= avail) return 0;
+		*value |= (uint64_t)(in[i] & 0x7f) << (7*i);
+		if (!(in[i] & 0x80)) return i + 1;
+	}
+	return -1;
+}
+
+static void mqu_put_be32(uint8_t *out, uint32_t value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+static uint32_t mqu_get_be32(const uint8_t *in)
+{
+	return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+}
+
+size_t mqu_frame_header(uint8_t *header, int framing, size_t len, unsigned prio)
+{
+	if (MQU_FRAMING_LEN32 == framing) {
+		mqu_put_be32(header, len);
+		mqu_put_be32(header + 4, prio);
+		return 8;
+	}
+	size_t n = mqu_put_varint(header, len);
+	return n + mqu_put_varint(header + n, prio);
+}
+
+int mqu_parse_frame(const uint8_t *data, size_t avail, int framing, size_t *len, unsigned *prio)
+{
+	if (MQU_FRAMING_LEN32 == framing) {
+		if (avail < 8) return 0;
+		*len = mqu_get_be32(data);
+		*prio = mqu_get_be32(data + 4);
+		return 8;
+	}
+
+	uint64_t length, priority;
+	int n = mqu_get_varint(data, avail, 10, &length);
+	if (n <= 0) return n;
+	int m = mqu_get_varint(data + n, avail - n, 5, &priority);
+	if (m <= 0) return m;
+	if (priority > UINT32_MAX) return -1;
+	*len = length;
+	*prio = priority;
+	return n + m;
+}
+
+size_t mqu_record_header(uint8_t *header, uint64_t delay, size_t len, unsigned prio)
+{
+	size_t n = mqu_put_varint(header, delay);
+	return n + mqu_frame_header(header + n, MQU_FRAMING_VARINT, len, prio);
+}
+
+int mqu_parse_record(const uint8_t *data, size_t avail, uint64_t *delay, size_t *len, unsigned *prio)
+{
+	int n = mqu_get_varint(data, avail, 10, delay);
+	if (n <= 0) return n;
+	int m = mqu_parse_frame(data + n, avail - n, MQU_FRAMING_VARINT, len, prio);
+	if (m <= 0) return m;
+	return n + m;
+}
+
+size_t mqu_pack_add(uint8_t *pack, size_t used, size_t size, const void *data, size_t len)
+{
+	uint8_t header[10];
+	size_t n = mqu_put_varint(header, len);
+
+	if (0 == used) {
+		if (size < 1) return 0;
+		pack[used++] = MQU_PACK_MAGIC;
+	}
+	if (used + n + len > size) return 0;
+	memcpy(pack + used, header, n);
+	memcpy(pack + used + n, data, len);
+	return used + n + len;
+}
+
+int mqu_unpack(const uint8_t *pack, size_t len, size_t *offset, const uint8_t **data, size_t *record_len)
+{
+	uint64_t length;
+
+	if (0 == *offset) {
+		if (0 == len || MQU_PACK_MAGIC != pack[0]) return -1;
+		*offset = 1;
+	}
+	if (*offset >= len) return 0;
+
+	int n = mqu_get_varint(pack + *offset, len - *offset, 10, &length);
+	if (n <= 0 || length > len - *offset - n) return -1;
+	*data = pack + *offset + n;
+	*record_len = length;
+	*offset += n + length;
+	return 1;
+}
+
+
+int mqu_send(mqd_t mqd, struct mqu_stats *stats, const void *data, size_t len, unsigned prio,
+             const struct timespec *deadline)
+{
+	uint64_t start = mqu_stats_start(stats);
+	int rv = deadline ? mq_timedsend(mqd, data, len, prio, deadline) : mq_send(mqd, data, len, prio);
+	mqu_stats_record(stats, MQU_STATS_SEND, start, rv ? -1 : (ssize_t)len, prio);
+	return rv;
+}
+
+ssize_t mqu_receive(mqd_t mqd, struct mqu_stats *stats, void *buffer, size_t size, unsigned *prio,
+                    const struct timespec *deadline)
+{
+	unsigned priority = 0;
+	uint64_t start = mqu_stats_start(stats);
+	ssize_t n = deadline ? mq_timedreceive(mqd, buffer, size, &priority, deadline)
+	                     : mq_receive(mqd, buffer, size, &priority);
+	mqu_stats_record(stats, MQU_STATS_RECV, start, n, priority);
+	if (prio) *prio = priority;
+	return n;
+}
+
+struct mqu_queue {
+	mqd_t mqd;
+	long maxmsg;
+	long msgsize;
+	struct mqu_stats *stats;
+};
+
+struct mqu_queue *mqu_queue_open(const char *name, int oflag, mode_t mode, const struct mq_attr *attr)
+{
+	struct mq_attr current;
+	struct mqu_queue *queue = calloc(1, sizeof(*queue));
+	if (!queue) return NULL;
+
+	queue->mqd = (oflag & O_CREAT) ? mq_open(name, oflag, mode, attr) : mq_open(name, oflag);
+	if (-1 == queue->mqd || 0 != mq_getattr(queue->mqd, &current)) {
+		int saved_errno = errno;
+		if (-1 != queue->mqd) mq_close(queue->mqd);
+		free(queue);
+		errno = saved_errno;
+		return NULL;
+	}
+	queue->maxmsg = current.mq_maxmsg;
+	queue->msgsize = current.mq_msgsize;
+	return queue;
+}
+
+void mqu_queue_close(struct mqu_queue *queue)
+{
+	mq_close(queue->mqd);
+	free(queue);
+}
+
+void mqu_queue_set_stats(struct mqu_queue *queue, struct mqu_stats *stats)
+{
+	queue->stats = stats;
+}
+
+mqd_t mqu_queue_descriptor(const struct mqu_queue *queue)
+{
+	return queue->mqd;
+}
+
+long mqu_queue_maxmsg(const struct mqu_queue *queue)
+{
+	return queue->maxmsg;
+}
+
+long mqu_queue_msgsize(const struct mqu_queue *queue)
+{
+	return queue->msgsize;
+}
+
+/* Return the deadline of a call, or NULL to wait as the descriptor does */
+static const struct timespec *mqu_queue_deadline(struct timespec *deadline, int64_t timeout)
+{
+	if (timeout < 0) return NULL;
+	mqu_deadline(deadline, timeout);
+	return deadline;
+}
+
+int mqu_queue_send(struct mqu_queue *queue, const void *data, size_t len, unsigned prio, int64_t timeout)
+{
+	struct timespec ts;
+	const struct timespec *deadline = mqu_queue_deadline(&ts, timeout);
+	int rv;
+
+	while (0 != (rv = mqu_send(queue->mqd, queue->stats, data, len, prio, deadline)) && EINTR == errno);
+	return rv;
+}
+
+ssize_t mqu_queue_send_batch(struct mqu_queue *queue, const struct mqu_message *messages, size_t count,
+                             int64_t timeout)
+{
+	struct timespec ts;
+	const struct timespec *deadline = mqu_queue_deadline(&ts, timeout);
+	size_t sent = 0;
+
+	while (sent < count) {
+		const struct mqu_message *message = &messages[sent];
+		if (0 != mqu_send(queue->mqd, queue->stats, message->data, message->len, message->prio, deadline)) {
+			if (EINTR == errno) continue;
+			return sent ? (ssize_t)sent : -1;
+		}
+		sent++;
+	}
+	return sent;
+}
+
+ssize_t mqu_queue_receive(struct mqu_queue *queue, void *buffer, size_t size, unsigned *prio, int64_t timeout)
+{
+	struct timespec ts;
+	const struct timespec *deadline = mqu_queue_deadline(&ts, timeout);
+	ssize_t n;
+
+	while ((n = mqu_receive(queue->mqd, queue->stats, buffer, size, prio, deadline)) < 0 && EINTR == errno);
+	return n;
+}
+
+ssize_t mqu_queue_receive_burst(struct mqu_queue *queue, struct mqu_message *messages, size_t max,
+                                void *buffer, size_t size, int64_t timeout)
+{
+	/* a deadline in the past takes the queued messages without waiting,
+	 * whatever the O_NONBLOCK flag of the descriptor */
+	static const struct timespec now = { 0, 0 };
+	uint8_t *data = buffer;
+	size_t count = 0;
+
+	while (count < max && size >= (size_t)queue->msgsize) {
+		ssize_t n;
+		if (0 == count) n = mqu_queue_receive(queue, data, size, &messages[0].prio, timeout);
+		else n = mqu_receive(queue->mqd, queue->stats, data, size, &messages[count].prio, &now);
+		if (n < 0) {
+			if (count && EINTR == errno) continue;
+			break;
+		}
+		messages[count].data = data;
+		messages[count].len = n;
+		count++;
+		data += n;
+		size -= n;
+	}
+	return count ? (ssize_t)count : -1;
+}
@@ -0,0 +1,370 @@
+/* libmq: the engine of the mq command, for use in other programs
+ *
+ * It provides queue handles with batched send and burst receive,
+ * the framing of records in streams, and statistics of the calls
+ * to the mqueue API.
+ */
+#ifndef LIBMQ_H
+#define LIBMQ_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <mqueue.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Time */
+
+/* Nanoseconds of the monotonic clock */
+uint64_t mqu_now_ns(void);
+
+/* Compute the absolute deadline of mq_timedsend and mq_timedreceive,
+ * which use CLOCK_REALTIME, timeout nanoseconds from now */
+void mqu_deadline(struct timespec *deadline, int64_t timeout);
+
+/* Histograms */
+
+/* Log-linear histogram of values, with a relative error below 1/MQU_HIST_SUB */
+#define MQU_HIST_SUB_BITS 4
+#define MQU_HIST_SUB (1 << MQU_HIST_SUB_BITS)
+#define MQU_HIST_BUCKETS (64 * MQU_HIST_SUB)
+
+struct mqu_histogram {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[MQU_HIST_BUCKETS];
+};
+
+void mqu_hist_add(struct mqu_histogram *hist, uint64_t value);
+void mqu_hist_merge(struct mqu_histogram *hist, const struct mqu_histogram *other);
+
+/* Value below which the given percentage of the values fall */
+uint64_t mqu_hist_percentile(const struct mqu_histogram *hist, double percent);
+
+/* Statistics */
+
+/* Statistics of the calls to the mqueue API, updated without locks
+ * from any thread, and optionally reported as JSON lines */
+struct mqu_stats;
+
+#define MQU_STATS_PRIOS 32 /* higher priorities are counted in the last lane */
+
+enum {
+	MQU_STATS_SEND,
+	MQU_STATS_RECV,
+	MQU_STATS_OPS
+};
+
+struct mqu_stats_times {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+	uint64_t max_ns;
+};
+
+struct mqu_stats_counts {
+	uint64_t messages;
+	uint64_t bytes;
+	uint64_t max_bytes; /* size of the largest message */
+	uint64_t eagain;
+	uint64_t etimedout;
+	uint64_t errors;
+	uint64_t priorities[MQU_STATS_PRIOS];
+	struct mqu_stats_times time; /* nanoseconds per call */
+};
+
+struct mqu_stats_snapshot {
+	double elapsed; /* seconds since mqu_stats_new */
+	struct mqu_stats_counts ops[MQU_STATS_OPS];
+	struct mqu_stats_times wait; /* nanoseconds blocked waiting for messages */
+};
+
+/* Create statistics, reported to out every interval seconds if interval > 0
+ * and when they are freed. out may be NULL to never report.
+ * Return NULL if memory is exhausted. */
+struct mqu_stats *mqu_stats_new(FILE *out, double interval);
+
+/* Stop the periodic reports and print the final one */
+void mqu_stats_free(struct mqu_stats *stats);
+
+/* Print the cumulated statistics as one line of JSON */
+void mqu_stats_report(struct mqu_stats *stats);
+
+void mqu_stats_snapshot(struct mqu_stats *stats, struct mqu_stats_snapshot *snapshot);
+
+/* Return the start time of a call, if statistics are enabled (stats not NULL) */
+uint64_t mqu_stats_start(const struct mqu_stats *stats);
+
+/* Account for a call to mq_send or mq_receive
+ *
+ * result is the size of the message, or -1 if the call failed
+ * (with errno set).
+ */
+void mqu_stats_record(struct mqu_stats *stats, int op, uint64_t start, ssize_t result, unsigned prio);
+
+/* Account for the time spent waiting for messages */
+void mqu_stats_wait(struct mqu_stats *stats, uint64_t start);
+
+/* Framing */
+
+/* Framing of records in a stream, used instead of delimiters
+ *
+ * Each record is [length][priority][payload], with the length and
+ * priority as 32-bit big endian integers (len32) or as LEB128
+ * variable-length integers (varint).
+ */
+enum {
+	MQU_FRAMING_NONE,
+	MQU_FRAMING_LEN32,
+	MQU_FRAMING_VARINT,
+};
+
+#define MQU_FRAME_HEADER_MAX 15 /* 10 bytes of varint length, 5 of priority */
+
+/* Write the header of a record, return its size */
+size_t mqu_frame_header(uint8_t *header, int framing, size_t len, unsigned prio);
+
+/* Parse the header of a record
+ *
+ * Return the size of the header, 0 if incomplete, -1 if invalid.
+ */
+int mqu_parse_frame(const uint8_t *data, size_t avail, int framing, size_t *len, unsigned *prio);
+
+/* Recordings of queue traffic
+ *
+ * A recording is MQU_RECORDING_MAGIC, then records [time][length][priority]
+ * [payload], where time is the number of nanoseconds since the previous
+ * record (of the monotonic clock), and the header is in LEB128 varints.
+ */
+#define MQU_RECORDING_MAGIC "mqrec1\n" /* 8 bytes with the NUL */
+#define MQU_RECORDING_MAGIC_SIZE 8
+#define MQU_RECORD_HEADER_MAX (10 + MQU_FRAME_HEADER_MAX)
+
+/* Write the header of a record, return its size */
+size_t mqu_record_header(uint8_t *header, uint64_t delay, size_t len, unsigned prio);
+
+/* Parse the header of a record
+ *
+ * Return the size of the header, 0 if incomplete, -1 if invalid.
+ */
+int mqu_parse_record(const uint8_t *data, size_t avail, uint64_t *delay, size_t *len, unsigned *prio);
+
+/* Packing of records
+ *
+ * A pack is a message that holds several records: MQU_PACK_MAGIC, then
+ * for each record its length as a LEB128 varint, and its payload. The
+ * records have the priority of the message. MQU_PACK_MAGIC is not in
+ * UTF-8 text either.
+ */
+#define MQU_PACK_MAGIC 0xff
+
+/* Append a record to a pack of used bytes (0 for a new pack), in a
+ * buffer of size bytes
+ *
+ * Return the new size of the pack, or 0 if the record does not fit.
+ */
+size_t mqu_pack_add(uint8_t *pack, size_t used, size_t size, const void *data, size_t len);
+
+/* Get the record at *offset of a pack of len bytes (0 for the first
+ * record), and move *offset to the next one
+ *
+ * Return 1 if a record was found, 0 at the end of the pack, -1 if the
+ * message is not a valid pack.
+ */
+int mqu_unpack(const uint8_t *pack, size_t len, size_t *offset, const uint8_t **data, size_t *record_len);
+
+/* Compression of messages
+ *
+ * A compressed message is a header byte, MQU_CODEC_BASE + codec, then the
+ * compressed data. These bytes never appear in UTF-8 text, so compressed
+ * and plain text messages can share a queue. A message that does not get
+ * smaller is sent as is, unless it starts with such a byte, in which case
+ * it is escaped with MQU_CODEC_BASE + MQU_CODEC_NONE.
+ */
+enum {
+	MQU_CODEC_NONE,
+	MQU_CODEC_LZ4,
+	MQU_CODEC_ZSTD,
+	MQU_CODEC_ZLIB,
+	MQU_CODECS
+};
+
+#define MQU_CODEC_BASE 0xf8
+
+/* Contexts of compression and decompression, reused across messages
+ * by a single thread at a time */
+struct mqu_codec;
+
+/* Return 1 if the codec was available when libmq was built */
+int mqu_codec_available(int codec);
+
+/* Create the contexts to compress with codec (at level, 0 for its default),
+ * and to decompress any codec, with an optional dictionary (zstd, zlib)
+ *
+ * Return NULL on error, with errno set (ENOTSUP for an unavailable codec).
+ */
+struct mqu_codec *mqu_codec_new(int codec, int level, const void *dict, size_t dict_len);
+void mqu_codec_free(struct mqu_codec *codec);
+
+/* Encode a message into out, which holds len + 1 bytes
+ *
+ * Return the encoded size, and set result to out, or to data when the
+ * message is sent as is.
+ */
+size_t mqu_compress(struct mqu_codec *codec, const void *data, size_t len, void *out, const void **result);
+
+/* Decode a message into out, which holds size bytes
+ *
+ * Return the decoded size, and set result to out or into data. Messages
+ * that are not encoded are returned as is. Return (size_t)-1 and set
+ * errno to EBADMSG if the message is corrupt, truncated or compressed
+ * with a codec missing from this build.
+ */
+size_t mqu_decompress(struct mqu_codec *codec, const void *data, size_t len, void *out, size_t size,
+                      const void **result);
+
+/* Calls on descriptors */
+
+/* mq_send, or mq_timedsend if deadline is not NULL, accounted in stats
+ * (which may be NULL) */
+int mqu_send(mqd_t mqd, struct mqu_stats *stats, const void *data, size_t len, unsigned prio,
+             const struct timespec *deadline);
+
+/* mq_receive, or mq_timedreceive if deadline is not NULL, accounted in stats
+ * (which may be NULL) */
+ssize_t mqu_receive(mqd_t mqd, struct mqu_stats *stats, void *buffer, size_t size, unsigned *prio,
+                    const struct timespec *deadline);
+
+/* Queue handles */
+
+struct mqu_queue;
+
+struct mqu_message {
+	void *data;
+	size_t len;
+	unsigned prio;
+};
+
+/* Open a queue, as mq_open does (mode and attr are used with O_CREAT)
+ *
+ * Return NULL on error, with errno set.
+ */
+struct mqu_queue *mqu_queue_open(const char *name, int oflag, mode_t mode, const struct mq_attr *attr);
+void mqu_queue_close(struct mqu_queue *queue);
+
+/* Account for the calls on the queue in stats, NULL to stop */
+void mqu_queue_set_stats(struct mqu_queue *queue, struct mqu_stats *stats);
+
+mqd_t mqu_queue_descriptor(const struct mqu_queue *queue);
+long mqu_queue_maxmsg(const struct mqu_queue *queue);
+long mqu_queue_msgsize(const struct mqu_queue *queue);
+
+/* In the functions below, timeout is in nanoseconds, and -1 waits
+ * as the descriptor does (forever, unless opened with O_NONBLOCK).
+ * A timeout sets errno to ETIMEDOUT. */
+
+/* Send a message
+ *
+ * Return 0 on success, -1 on error.
+ */
+int mqu_queue_send(struct mqu_queue *queue, const void *data, size_t len, unsigned prio, int64_t timeout);
+
+/* Send count messages in order, within timeout for all of them
+ *
+ * Return the number of messages sent, which is less than count
+ * if an error occurred after the first one, or -1 if none was sent.
+ */
+ssize_t mqu_queue_send_batch(struct mqu_queue *queue, const struct mqu_message *messages, size_t count,
+                             int64_t timeout);
+
+/* Receive a message into buffer, which must hold msgsize bytes
+ *
+ * Return the size of the message, or -1 on error.
+ */
+ssize_t mqu_queue_receive(struct mqu_queue *queue, void *buffer, size_t size, unsigned *prio, int64_t timeout);
+
+/* Wait for a message within timeout, then take the messages already queued
+ *
+ * At most max messages are received, one after the other in buffer,
+ * while at least msgsize bytes are left. messages[i].data points into buffer.
+ * Return the number of messages received, or -1 if none was.
+ */
+ssize_t mqu_queue_receive_burst(struct mqu_queue *queue, struct mqu_message *messages, size_t max,
+                                void *buffer, size_t size, int64_t timeout);
+
+/* Queues in shared memory
+ *
+ * They behave as message queues, without system calls unless a side
+ * has to sleep, and without the limits of the kernel on their depth.
+ * Priorities 0 to MQU_SHM_LANES-2 have their own lane, higher priorities
+ * share the last one in the order they were sent.
+ * The shared memory object of queue "/name" is "/mq.name".
+ */
+#define MQU_SHM_LANES 4
+
+struct mqu_shm;
+
+/* Open a queue, as mq_open does (mode and attr are used with O_CREAT)
+ *
+ * Receiving moves the indexes of the queue, so receivers open it O_RDWR,
+ * senders O_WRONLY or O_RDWR; a handle opened O_RDONLY maps it read-only,
+ * for mqu_shm_getattr, and fails to send or receive with EBADF.
+ * Return NULL on error, with errno set.
+ */
+struct mqu_shm *mqu_shm_open(const char *name, int oflag, mode_t mode, const struct mq_attr *attr);
+void mqu_shm_close(struct mqu_shm *shm);
+int mqu_shm_unlink(const char *name);
+int mqu_shm_getattr(const struct mqu_shm *shm, struct mq_attr *attr);
+
+/* Send and receive as mqu_queue_send and mqu_queue_receive do, one copy
+ * each. Threads may share a handle. */
+int mqu_shm_send(struct mqu_shm *shm, struct mqu_stats *stats, const void *data, size_t len, unsigned prio,
+                 int64_t timeout);
+ssize_t mqu_shm_receive(struct mqu_shm *shm, struct mqu_stats *stats, void *buffer, size_t size, unsigned *prio,
+                        int64_t timeout);
+
+/* Spilling to disk
+ *
+ * A spill sends messages to a queue, and appends the ones that find it
+ * full to segment files in a directory, which a thread of the spill
+ * re-injects in order once the queue has room. The messages left
+ * when the spill is closed without draining, or when the process dies,
+ * are re-injected first by the next spill of the queue in the directory.
+ * The files are mapped, so they survive the process, not the system.
+ */
+struct mqu_spill;
+
+/* Open the spill of queue name in dir (created if needed), to send on mqd
+ *
+ * Return NULL on error, with errno set (EWOULDBLOCK if another process
+ * uses the spill).
+ */
+struct mqu_spill *mqu_spill_open(const char *dir, const char *name, mqd_t mqd, struct mqu_stats *stats);
+
+/* Send a message without waiting, or spill it if the queue is full
+ * or older messages are still spilled
+ *
+ * Return 0 on success, -1 on error (also if re-injecting failed).
+ */
+int mqu_spill_send(struct mqu_spill *spill, const void *data, size_t len, unsigned prio);
+
+/* Number of messages spilled and not yet re-injected */
+size_t mqu_spill_pending(struct mqu_spill *spill);
+
+/* Close the spill, after re-injecting all the messages if drain is set
+ *
+ * Return 0 on success, -1 if re-injecting failed, with errno set.
+ */
+int mqu_spill_close(struct mqu_spill *spill, int drain);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
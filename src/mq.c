@@ -1,3 +1,7 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <argp.h>
 #include <mqueue.h>
@@ -8,8 +12,43 @@
 #include <time.h>
 #include <poll.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <signal.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "libmq.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#define MQU_USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #define PROG_NAME "mq"
+#define MQU_MAX_THREADS 1024 /* for --workers, --threads, --producers and --consumers */
+#define MQ_DIR "/dev/mqueue" /* where the mqueue filesystem is mounted */
+#define SHM_DIR "/dev/shm" /* where shm_open creates objects */
+#define SHM_PREFIX "mq." /* of the objects of shm queues */
 const char *argp_program_version = PROG_NAME " 1.0";
 
 static char doc[] = 
@@ -20,34 +59,147 @@ static char doc[] =
 	"  unlink    Delete a message queue\n"
 	"  send      Send a message to a message queue\n"
 	"  recv      Receive and print a message from a message queue\n"
+	"  relay     Forward the messages of a queue to other queues\n"
+	"  record    Record the messages of a queue, with their timing, to a file\n"
+	"  replay    Send the messages of a recording to a queue\n"
+	"  top       Monitor the depth of queues (all queues by default)\n"
+	"  bench     Measure the throughput and latency of a temporary queue\n"
 	"\n"
 	"Delimiters:\n"
 	"  n         new line (LF) [default]\n"
 	"  z         zero (NUL)\n"
 	"\n"
+	"Framings (recv output, send --stdin input):\n"
+	"  len32     32-bit big endian length and priority, then the message\n"
+	"  varint    LEB128 length and priority, then the message\n"
+	"\n"
+	"Formats:\n"
+	"  raw       the message as received [default]\n"
+	"  hex       hexadecimal digits\n"
+	"\n"
+	"Formats of info and bench:\n"
+	"  raw       name: maxmsg=..., msgsize=..., ... [default]\n"
+	"  json      an array of objects (info), one object per line (bench)\n"
+	"  csv       a header line, then one line per queue or run\n"
+	"  prometheus  gauges in the Prometheus text format (info)\n"
+	"\n"
+	"Transports (create, info, unlink, send, recv, bench):\n"
+	"  mq        POSIX message queues [default]\n"
+	"  shm       lock-free rings in shared memory (" SHM_DIR "/" SHM_PREFIX "NAME)\n"
+	"\n"
+	"Codecs (send, recv --compress; the first one available is the default):\n"
+#ifdef HAVE_LZ4
+	"  lz4       fastest\n"
+#endif
+#ifdef HAVE_ZSTD
+	"  zstd      smaller, and with the dictionary of --dictionary\n"
+#endif
+#ifdef HAVE_ZLIB
+	"  zlib      deflate, with the dictionary of --dictionary\n"
+#endif
+	"  none      do not compress, only decompress (recv)\n"
+	"\n"
+	"Wakeups (recv -f, relay, bench):\n"
+	"  poll      poll the queue descriptors (epoll if available) [default]\n"
+	"  notify    mq_notify with a real-time signal\n"
+	"  blocking  blocking mq_receive, a single queue only [default of bench]\n"
+	"\n"
+	"Durations:\n"
+	"  a number followed by ns, us, ms, s [default] or m, e.g. 50ms\n"
+	"\n"
+	"Timestamps:\n"
+	"  local     2017-01-01 12:00:00.000, local time [default]\n"
+	"  iso       2017-01-01T12:00:00.000Z, UTC\n"
+	"  mono      seconds.nanoseconds of the monotonic clock\n"
+	"  epoch-ns  nanoseconds since the Epoch\n"
+	"\n"
+	"Queue names given to info, recv and top, and the source of relay, may contain wildcards\n"
+	"(*, ?, [...]). They are matched against the queues listed in " MQ_DIR ".\n"
+	"\n"
 	"\n"
 	"Examples:\n"
 	"  mq create /myqueue\n"
 	"  mq send /myqueue \"hello\" -n\n"
+	"  printf 'a\\nb\\n' | mq send /myqueue --stdin\n"
 	"  mq info /myqueue\n"
+	"  mq info --all --format=prometheus\n"
 	"  mq recv /myqueue\n"
+	"  mq recv --timeout=50ms --count=100 /myqueue\n"
+	"  mq recv -f --print-name /myqueue '/app.*'\n"
 	"  mq unlink /myqueue\n"
+	"  mq relay /myqueue /copy1 /copy2\n"
+	"  mq record /myqueue traffic.mqrec --timeout=10\n"
+	"  mq replay traffic.mqrec /myqueue --speed=2\n"
+	"  mq top --interval=0.5 '/app.*'\n"
+	"  mq bench -m 100 -s 256 --producers=2 --consumers=2 --duration=5\n"
 	"\n"
 	;
 
 static char args_doc[] =
 	"create QNAME\n"
-	"info QNAME\n"
+	"info QNAME...\n"
+	"info --all\n"
 	"unlink QNAME\n"
 	"send QNAME MESSAGE\n"
-	"recv QNAME"
+	"send --stdin QNAME\n"
+	"recv QNAME\n"
+	"recv -f QNAME...\n"
+	"relay SRC DST...\n"
+	"record QNAME FILE\n"
+	"replay FILE QNAME\n"
+	"top [QNAME...]\n"
+	"bench"
 	;
 
+static const char mqu_hex_digits[] = "0123456789abcdef";
+
+/* Encode size bytes as 2*size hexadecimal digits */
+static void mqu_hex_encode(char *out, const uint8_t *in, size_t size)
+{
+	size_t i = 0;
+#if defined(__SSSE3__)
+	const __m128i lut = _mm_loadu_si128((const __m128i *)mqu_hex_digits);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	for (; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+		__m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+		_mm_storeu_si128((__m128i *)(out + 2*i), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(out + 2*i + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	const uint8x16_t lut = vld1q_u8((const uint8_t *)mqu_hex_digits);
+	for (; i + 16 <= size; i += 16) {
+		uint8x16_t v = vld1q_u8(in + i);
+		uint8x16x2_t digits;
+		digits.val[0] = vqtbl1q_u8(lut, vshrq_n_u8(v, 4));
+		digits.val[1] = vqtbl1q_u8(lut, vandq_u8(v, vdupq_n_u8(0x0f)));
+		vst2q_u8((uint8_t *)out + 2*i, digits);
+	}
+#endif
+	for (; i<size; i++) {
+		out[2*i] = mqu_hex_digits[in[i] >> 4];
+		out[2*i+1] = mqu_hex_digits[in[i] & 0x0f];
+	}
+}
+
+/* Print bytes as space-separated hexadecimal, by chunks of one fwrite */
 static void print_hexa(const uint8_t *buffer, size_t size)
 {
-	for (size_t i=0; i<size; i++) {
-		if (i > 0) printf(" ");
-		printf("%02x", buffer[i]);
+	char chunk[3 * 1024];
+
+	while (size > 0) {
+		size_t n = size < 1024 ? size : 1024;
+		char *out = chunk;
+		for (size_t i=0; i<n; i++) {
+			*out++ = mqu_hex_digits[buffer[i] >> 4];
+			*out++ = mqu_hex_digits[buffer[i] & 0x0f];
+			*out++ = ' ';
+		}
+		buffer += n;
+		size -= n;
+		/* no trailing space after the last byte */
+		fwrite(chunk, 1, out - chunk - (0 == size), stdout);
 	}
 }
 
@@ -64,86 +216,779 @@ static void print_hexa(const uint8_t *buffer, size_t size)
 #define LOG_VERBOSE_HEXA(_args, buffer, size) \
 		do { if (_args->verbose) { \
 			printf("%s ", get_timestamp()); \
-			print_hexa(buffer, size); /* TODO */ \
+			print_hexa(buffer, size); \
 			printf("\n"); } \
 		} while (0)
 
+/* Output formats of messages */
+enum {
+	MQU_FMT_RAW,
+	MQU_FMT_HEX,
+	MQU_FMT_JSON,       /* info, bench */
+	MQU_FMT_CSV,        /* info, bench */
+	MQU_FMT_PROMETHEUS, /* info only */
+};
+
+/* Where messages are queued */
+enum {
+	MQU_TRANSPORT_MQ,  /* POSIX message queues */
+	MQU_TRANSPORT_SHM, /* rings in shared memory, see libmq.h */
+};
+
+/* How recv -f, relay and bench wait for messages */
+enum {
+	MQU_WAKEUP_AUTO,     /* poll, or blocking for bench */
+	MQU_WAKEUP_POLL,     /* poll or epoll on the queue descriptors */
+	MQU_WAKEUP_NOTIFY,   /* mq_notify with a real-time signal */
+	MQU_WAKEUP_BLOCKING, /* blocking mq_receive, single queue */
+};
+
+/* Timestamp formats */
+enum {
+	MQU_TS_NONE,
+	MQU_TS_LOCAL,    /* 2017-01-01 12:00:00.000 (local time) */
+	MQU_TS_ISO,      /* 2017-01-01T12:00:00.000Z (UTC) */
+	MQU_TS_MONO,     /* seconds.nanoseconds of CLOCK_MONOTONIC */
+	MQU_TS_EPOCH_NS, /* nanoseconds since the Epoch */
+};
+
+#define MQU_TIMESTAMP_MAX 32 /* size of a buffer large enough for all formats */
+
+#ifdef CLOCK_REALTIME_COARSE
+#define MQU_CLOCK_REALTIME(_coarse) ((_coarse) ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME)
+#define MQU_CLOCK_MONOTONIC(_coarse) ((_coarse) ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC)
+#else
+#define MQU_CLOCK_REALTIME(_coarse) CLOCK_REALTIME
+#define MQU_CLOCK_MONOTONIC(_coarse) CLOCK_MONOTONIC
+#endif
+
+/* Write the decimal digits of value, return their number */
+static size_t mqu_format_u64(char *buffer, uint64_t value)
+{
+	char digits[20];
+	size_t n = 0;
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	for (size_t i=0; i<n; i++) buffer[i] = digits[n - 1 - i];
+	return n;
+}
+
+/* Write value with exactly width digits */
+static void mqu_format_padded(char *buffer, unsigned long value, int width)
+{
+	for (int i=width-1; i>=0; i--) {
+		buffer[i] = '0' + value % 10;
+		value /= 10;
+	}
+}
+
+/* Format the current time
+ *
+ * The date and time of day are formatted once per second, and only
+ * the milliseconds are patched in for the other calls.
+ * Return the length written in buffer (not NUL-terminated).
+ */
+static size_t mqu_timestamp(char *buffer, int format, int coarse)
+{
+	static _Thread_local char prefix[2][MQU_TIMESTAMP_MAX];
+	static _Thread_local size_t prefix_len[2];
+	static _Thread_local time_t prefix_sec[2] = { -1, -1 };
+	struct timespec ts;
+	size_t len;
+
+	switch (format) {
+	case MQU_TS_MONO:
+		clock_gettime(MQU_CLOCK_MONOTONIC(coarse), &ts);
+		len = mqu_format_u64(buffer, ts.tv_sec);
+		buffer[len++] = '.';
+		mqu_format_padded(buffer + len, ts.tv_nsec, 9);
+		return len + 9;
+
+	case MQU_TS_EPOCH_NS:
+		clock_gettime(MQU_CLOCK_REALTIME(coarse), &ts);
+		return mqu_format_u64(buffer, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+
+	case MQU_TS_LOCAL:
+	case MQU_TS_ISO:
+	default: {
+		int utc = (MQU_TS_ISO == format);
+		clock_gettime(MQU_CLOCK_REALTIME(coarse), &ts);
+		if (ts.tv_sec != prefix_sec[utc]) {
+			struct tm date;
+			if (utc) gmtime_r(&ts.tv_sec, &date);
+			else localtime_r(&ts.tv_sec, &date);
+			prefix_len[utc] = strftime(prefix[utc], sizeof(prefix[utc]),
+			                           utc ? "%Y-%m-%dT%H:%M:%S." : "%Y-%m-%d %H:%M:%S.", &date);
+			prefix_sec[utc] = ts.tv_sec;
+		}
+		len = prefix_len[utc];
+		memcpy(buffer, prefix[utc], len);
+		mqu_format_padded(buffer + len, ts.tv_nsec / 1000000, 3);
+		len += 3;
+		if (utc) buffer[len++] = 'Z';
+		return len;
+	}
+	}
+}
+
 static char *get_timestamp(void)
 {
-	static char buffer[256];
-	struct tm date;
-	struct timeval tv;
-	gettimeofday(&tv, 0);
-	localtime_r(&tv.tv_sec, &date);
-	int milliseconds = tv.tv_usec / 1000;
-	snprintf(buffer, sizeof(buffer), "%.4d-%.2d-%.2d %.2d:%.2d:%.2d.%03d",
-			date.tm_year + 1900,
-			date.tm_mon + 1,
-			date.tm_mday,
-			date.tm_hour,
-			date.tm_min,
-			date.tm_sec,
-			milliseconds);
+	static _Thread_local char buffer[MQU_TIMESTAMP_MAX];
+	size_t len = mqu_timestamp(buffer, MQU_TS_LOCAL, 0);
+	buffer[len] = '\0';
 	return buffer;
 }
 
+/* Parse a duration such as "50ms" or "1.5" (seconds) into nanoseconds
+ *
+ * Return 0 on success, -1 if the duration is invalid.
+ */
+static int mqu_parse_duration(const char *arg, int64_t *ns)
+{
+	static const struct {
+		const char *suffix;
+		double scale;
+	} units[] = {
+		{ "ns", 1 }, { "us", 1e3 }, { "ms", 1e6 }, { "s", 1e9 }, { "", 1e9 }, { "m", 60e9 },
+	};
+	char *end;
+	double value = strtod(arg, &end);
+
+	if (end == arg || value < 0) return -1;
+	for (size_t i=0; i<sizeof(units)/sizeof(units[0]); i++) {
+		if (0 == strcmp(end, units[i].suffix)) {
+			*ns = (int64_t)(value * units[i].scale);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Read the whole content of a file, return 0 on success, -1 on error */
+static int mqu_read_file(const char *path, void **data, size_t *len)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	if (0 != fstat(fd, &st) || NULL == (*data = malloc(st.st_size ? st.st_size : 1))) {
+		close(fd);
+		return -1;
+	}
+	*len = 0;
+	while (*len < (size_t)st.st_size) {
+		ssize_t n = read(fd, (uint8_t *)*data + *len, st.st_size - *len);
+		if (n < 0 && EINTR == errno) continue;
+		if (n <= 0) {
+			if (0 == n) errno = EIO;
+			free(*data);
+			close(fd);
+			return -1;
+		}
+		*len += n;
+	}
+	close(fd);
+	return 0;
+}
+
 static void usage(const struct argp *argp)
 {
 	argp_help(argp, stderr, ARGP_HELP_STD_HELP, (char *)PROG_NAME);
 }
 
+/* Keys of the options that have no short form */
+enum {
+	OPT_STDIN = 0x100,
+	OPT_PRINT_NAME,
+	OPT_PRODUCERS,
+	OPT_CONSUMERS,
+	OPT_DURATION,
+	OPT_COUNT,
+	OPT_PAYLOAD,
+	OPT_STATS,
+	OPT_STATS_FILE,
+	OPT_COARSE_TIME,
+	OPT_FORMAT,
+	OPT_ZERO_COPY,
+	OPT_FRAMING,
+	OPT_PRINT_PRIORITY,
+	OPT_MIN_PRIORITY,
+	OPT_WORKERS,
+	OPT_ORDERED,
+	OPT_THREADS,
+	OPT_RATE,
+	OPT_INTERVAL,
+	OPT_ALL,
+	OPT_WAKEUP,
+	OPT_TIMEOUT,
+	OPT_TRANSPORT,
+	OPT_SPILL,
+	OPT_SPEED,
+	OPT_COMPRESS,
+	OPT_DICTIONARY,
+	OPT_PACK,
+	OPT_LINGER,
+	OPT_AUTO,
+	OPT_SAMPLE,
+	OPT_CPU,
+	OPT_SCHED,
+	OPT_MLOCK,
+	OPT_BUSY_POLL,
+	OPT_MATCH,
+	OPT_CONTAINS,
+	OPT_REGEX,
+	OPT_ROUTE,
+	OPT_SWEEP,
+	OPT_TIMESTAMP,
+	OPT_MODE,
+};
+
 static struct argp_option options[] = {
 	{ 0, 0, 0, 0, "Options:" },
 	{ "verbose", 'v', 0, 0, "Produce verbose output" },
-	{ "timestamp", 't', 0, 0, "Print a timestamp before lines of data" },
+	{ "timestamp", OPT_TIMESTAMP, "FORMAT", OPTION_ARG_OPTIONAL,
+	  "Print a timestamp before lines of data (see timestamps)" },
+	{ 0, 't', 0, 0, "Same as --timestamp, in the default format" },
+	{ "coarse-time", OPT_COARSE_TIME, 0, 0, "Use the faster, lower resolution clocks for timestamps" },
+	{ "stats", OPT_STATS, "INTERVAL", OPTION_ARG_OPTIONAL,
+	  "Print statistics as JSON at exit, and every INTERVAL seconds if given" },
+	{ "stats-file", OPT_STATS_FILE, "FILE", 0, "Append statistics to FILE instead of stderr" },
+	{ "transport", OPT_TRANSPORT, "TRANSPORT", 0, "Queue messages with TRANSPORT (see transports)" },
+	{ "timeout", OPT_TIMEOUT, "DURATION", 0,
+	  "Wait at most DURATION (recv, send), or exit after DURATION without messages (recv -f, relay, record)" },
+	{ "count", OPT_COUNT, "N", 0, "Stop after N messages (recv, relay, record, replay) or N refreshes (top); "
+	  "bench: send N messages, instead of for a duration" },
 	{ 0, 0, 0, 0, "Options for create:" },
 	{ "msgsize", 's', "SIZE", 0, "Message size in bytes" },
 	{ "maxmsg", 'm', "NUMBER", 0, "Maximum number of messages in queue" },
+	{ "mode", OPT_MODE, "MODE", 0, "Permissions of the shm queue, in octal, less the umask (default 0644, with --transport=shm)" },
+	{ "auto", OPT_AUTO, 0, 0, "Size the queue within the limits of the system and RLIMIT_MSGQUEUE: "
+	  "msgsize from -s or --sample, and maxmsg from -m (raising RLIMIT_MSGQUEUE if needed) or as large as fits" },
+	{ "sample", OPT_SAMPLE, "FILE", 0, "With --auto, take msgsize from the largest message "
+	  "in the statistics of FILE (written by --stats)" },
+	{ 0, 0, 0, 0, "Options for bench (the queue is created with the options for create):" },
+	{ "producers", OPT_PRODUCERS, "N", 0, "Number of sending threads (default 1)" },
+	{ "consumers", OPT_CONSUMERS, "N", 0, "Number of receiving threads (default 1)" },
+	{ "duration", OPT_DURATION, "SECONDS", 0, "Send messages during SECONDS (default 1)" },
+	{ "payload", OPT_PAYLOAD, "SIZE", 0, "Size of the messages sent (default msgsize)" },
+	{ "sweep", OPT_SWEEP, 0, 0, "Run over message sizes from 16 bytes to msgsize_max, queue depths "
+	  "from 1 to msg_max, and 1 or 4 producers and consumers (-s and -m fix the size and depth)" },
+	{ 0, 0, 0, 0, "Options for info:" },
+	{ "all", OPT_ALL, 0, 0, "Print all the queues of " MQ_DIR },
+	{ 0, 0, 0, 0, "Options for top:" },
+	{ "interval", OPT_INTERVAL, "SECONDS", 0, "Refresh every SECONDS (default 1)" },
 	{ 0, 0, 0, 0, "Options for recv:" },
 	{ "follow", 'f', 0, 0, "Print messages as they are received" },
+	{ "workers", OPT_WORKERS, "N", 0, "Receive and format messages in N threads (with -f)" },
+	{ "ordered", OPT_ORDERED, 0, 0, "Print messages in the order of arrival (with --workers)" },
+	{ "print-name", OPT_PRINT_NAME, 0, 0, "Print the queue name before each message" },
+	{ "print-priority", OPT_PRINT_PRIORITY, 0, 0, "Print the priority before each message" },
+	{ "min-priority", OPT_MIN_PRIORITY, "PRIO", 0,
+	  "Discard the messages of priority lower than PRIO (recv, relay)" },
+	{ "match", OPT_MATCH, "PREFIX", 0, "Keep only the messages starting with PREFIX (recv, relay)" },
+	{ "contains", OPT_CONTAINS, "TEXT", 0, "Keep only the messages containing TEXT (recv, relay)" },
+	{ "regex", OPT_REGEX, "RE", 0, "Keep only the messages matching the extended regular expression RE "
+	  "(recv, relay)" },
+	{ "route", OPT_ROUTE, "RE:QNAME", 0, "Forward the messages matching RE to QNAME instead, "
+	  "the first matching route wins (recv -f, relay)" },
+	{ "wakeup", OPT_WAKEUP, "MODE", 0, "Wait for messages with MODE, with -f or bench (see wakeups)" },
+	{ "busy-poll", OPT_BUSY_POLL, "DURATION", 0, "Spin on non-blocking receives for DURATION (e.g. 50us) "
+	  "before waiting on the queues (with -f, relay)" },
+	{ "cpu", OPT_CPU, "LIST", 0, "Run on the CPUs of LIST, e.g. 0,2-3, one per worker with --workers "
+	  "(recv -f, relay)" },
+	{ "sched", OPT_SCHED, "POLICY", 0, "Schedule the receiving threads with POLICY: fifo:PRIO, rr:PRIO "
+	  "or other (recv -f, relay)" },
+	{ "mlock", OPT_MLOCK, 0, 0, "Lock the memory of the process, to avoid page faults (recv -f, relay)" },
+	{ "format", OPT_FORMAT, "FORMAT", 0, "Print messages, or the output of info and bench, as FORMAT (see formats)" },
+	{ "zero-copy", OPT_ZERO_COPY, 0, 0, "Hand the received messages to stdout with vmsplice, "
+	  "if it is a pipe (raw format, no prefixes)" },
 	{ 0, 0, 0, 0, "Options for send:" },
 	{ "priority", 'p', "PRIO", 0, "Use priority PRIO, PRIO >= 0" },
+	{ "stdin", OPT_STDIN, 0, 0, "Read messages from stdin, separated by the delimiter" },
+	{ "threads", OPT_THREADS, "N", 0, "Send from N threads, each with its own descriptor (with --stdin)" },
+	{ "rate", OPT_RATE, "MSGS", 0, "Send at most MSGS messages per second (with --stdin)" },
+	{ "linger", OPT_LINGER, "DURATION", 0, "With --pack, send a message once its first record has waited "
+	  "DURATION (default 0: as soon as no more input is ready)" },
+	{ "spill", OPT_SPILL, "DIR", 0, "Append the messages that find the queue full to files in DIR, "
+	  "and send them in order once it has room; with -n, leave them there for the next send --spill" },
+	{ 0, 0, 0, 0, "Options for replay:" },
+	{ "speed", OPT_SPEED, "FACTOR", 0, "Replay FACTOR times faster than recorded (default 1), "
+	  "0 as fast as possible" },
 	{ 0, 0, 0, 0, "Options for send, recv:" },
 	{ "non-blocking", 'n', 0, 0, "Do not block (send, recv)" },
 	{ "delimiter", 'd', "CHAR", 0, "Character to delimit the end of messages (see delimiters)" },
+	{ "framing", OPT_FRAMING, "FRAMING", 0, "Frame messages with a header instead of a delimiter (see framings)" },
+	{ "pack", OPT_PACK, 0, 0, "Pack as many records as fit into each message (send --stdin), "
+	  "and unpack them (recv)" },
+	{ "compress", OPT_COMPRESS, "CODEC", OPTION_ARG_OPTIONAL,
+	  "Compress the messages sent with CODEC, decompress the messages received (see codecs)" },
+	{ "dictionary", OPT_DICTIONARY, "FILE", 0, "Compress with the dictionary in FILE (with --compress)" },
 	{ 0 }
 };
 
+/* Messages kept by --match, --contains and --regex: all those given must match */
+struct mqu_filter {
+	const char *prefix; /* NULL if none */
+	size_t prefix_len;
+	const char *text; /* NULL if none */
+	size_t text_len;
+	regex_t *regex; /* NULL if none */
+};
+
+/* Messages forwarded by --route */
+struct mqu_route {
+	const char *qname;
+	regex_t regex;
+};
+
 struct arguments
 {
 	int verbose;
+	int stats; /* print statistics */
+	double stats_interval;
+	char *stats_file;
+	struct mqu_stats *stats_data; /* NULL if statistics are disabled */
+	int64_t timeout; /* nanoseconds, -1 to wait forever */
+	int transport; /* MQU_TRANSPORT_... */
 	char *command;
 	char *qname; /* name of the mq (should start with '/') */
+	char **qnames; /* all the names given on the command line (recv) */
+	int qcount;
 
 	/* for command 'create' */
 	int maxmsg; /* max number of message */
 	int msgsize; /* size of a message */
+	int maxmsg_given; /* with -m */
+	int msgsize_given; /* with -s */
+	mode_t mode; /* permissions of shm queues, with --mode */
+	int auto_size;
+	char *sample_file;
 
 	char delimiter;
+	int framing; /* MQU_FRAMING_... */
+	int pack;
+	int compress; /* MQU_CODEC_..., MQU_CODEC_NONE to only decompress, -1 for neither */
+	char *dictionary_file;
+	void *dictionary;
+	size_t dictionary_len;
 
-	int timestamp;
+	int timestamp; /* MQU_TS_... */
+	int coarse_time;
 	/* for command 'recv' */
 	int blocking;
 	int follow;
+	int print_name;
+	int print_priority;
+	int workers;
+	int ordered;
+	unsigned min_priority;
+	struct mqu_filter filter;
+	struct mqu_route *routes;
+	int nroutes;
+	int format; /* MQU_FMT_... */
+	int wakeup; /* MQU_WAKEUP_... */
+	int zero_copy;
+	int64_t busy_poll; /* nanoseconds spinning before waiting */
+	cpu_set_t cpus;
+	int ncpus; /* 0 to keep the affinity */
+	int sched_policy; /* -1 to keep the policy */
+	int sched_priority;
+	int mlock;
 
 	/* for command 'send' */
 	char *message;
 	size_t msglen;
 	int priority;
+	int from_stdin;
+	int threads;
+	double rate;
+	char *spill_dir; /* NULL if not spilling */
+	int64_t linger; /* nanoseconds a pack waits for more records */
+
+	/* for command 'bench' */
+	int producers;
+	int consumers;
+	double duration;
+	long count;
+	int payload;
+	int sweep;
+
+	/* for commands 'record' and 'replay' */
+	char *file;
+	double speed;
+
+	/* for command 'info' */
+	int all;
+
+	/* for command 'top' */
+	double interval;
 };
 
+/* Parse an integer from min to max
+ *
+ * Return 0 on success, -1 if arg is not a number in the range.
+ */
+static int mqu_parse_long(const char *arg, long min, long max, long *value)
+{
+	char *end;
+
+	errno = 0;
+	long v = strtol(arg, &end, 10);
+	if (end == arg || *end || ERANGE == errno || v < min || v > max) return -1;
+	*value = v;
+	return 0;
+}
+
+/* Parse a number from 0 to 1e15
+ *
+ * Return 0 on success, -1 if arg is not such a number.
+ */
+static int mqu_parse_number(const char *arg, double *value)
+{
+	char *end;
+
+	double v = strtod(arg, &end);
+	if (end == arg || *end || !(v >= 0) || v > 1e15) return -1;
+	*value = v;
+	return 0;
+}
+
+/* Parse a number greater than 0
+ *
+ * Return 0 on success, -1 if arg is not such a number.
+ */
+static int mqu_parse_positive(const char *arg, double *value)
+{
+	double v;
+
+	if (0 != mqu_parse_number(arg, &v) || 0 == v) return -1;
+	*value = v;
+	return 0;
+}
+
+/* Compile an extended regular expression, for --regex and --route */
+static int mqu_compile_regex(regex_t *regex, const char *re)
+{
+	int rv = regcomp(regex, re, REG_EXTENDED | REG_NOSUB);
+	if (0 != rv) {
+		char error[256];
+		regerror(rv, regex, error, sizeof(error));
+		LOG_ERR("Invalid regular expression '%s': %s", re, error);
+		return -1;
+	}
+	return 0;
+}
+
+/* Parse a list of CPUs such as 0,2-3
+ *
+ * Return the number of CPUs, or -1 if invalid.
+ */
+static int mqu_parse_cpus(const char *arg, cpu_set_t *cpus)
+{
+	const char *p = arg;
+
+	CPU_ZERO(cpus);
+	while (*p) {
+		char *end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+		if (end == p || first < 0) return -1;
+		if ('-' == *end) {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first) return -1;
+		}
+		if (last >= CPU_SETSIZE) return -1;
+		for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, cpus);
+		if (',' == *end) end++;
+		else if (*end) return -1;
+		p = end;
+	}
+	return CPU_COUNT(cpus);
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
 	struct arguments *args = state->input;
+	long value;
 
 	switch (key) {
 	case 'v': args->verbose = 1; break;
 	case 'n': args->blocking = 0; break;
-	case 't': args->timestamp = 1; break;
+	case 't': args->timestamp = MQU_TS_LOCAL; break;
+	case OPT_TIMESTAMP:
+		if (!arg || 0 == strcmp("local", arg)) args->timestamp = MQU_TS_LOCAL;
+		else if (0 == strcmp("iso", arg)) args->timestamp = MQU_TS_ISO;
+		else if (0 == strcmp("mono", arg)) args->timestamp = MQU_TS_MONO;
+		else if (0 == strcmp("epoch-ns", arg)) args->timestamp = MQU_TS_EPOCH_NS;
+		else {
+			LOG_ERR("Invalid timestamp format '%s' (use 'local', 'iso', 'mono' or 'epoch-ns')", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_COARSE_TIME: args->coarse_time = 1; break;
+	case OPT_ZERO_COPY: args->zero_copy = 1; break;
+	case OPT_FRAMING:
+		if (0 == strcmp("len32", arg)) args->framing = MQU_FRAMING_LEN32;
+		else if (0 == strcmp("varint", arg)) args->framing = MQU_FRAMING_VARINT;
+		else {
+			LOG_ERR("Invalid framing '%s' (use 'len32' or 'varint')", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_FORMAT:
+		if (0 == strcmp("raw", arg)) args->format = MQU_FMT_RAW;
+		else if (0 == strcmp("hex", arg)) args->format = MQU_FMT_HEX;
+		else if (0 == strcmp("json", arg)) args->format = MQU_FMT_JSON;
+		else if (0 == strcmp("csv", arg)) args->format = MQU_FMT_CSV;
+		else if (0 == strcmp("prometheus", arg)) args->format = MQU_FMT_PROMETHEUS;
+		else {
+			LOG_ERR("Invalid format '%s' (use 'raw', 'hex', 'json', 'csv' or 'prometheus')", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_TIMEOUT:
+		if (0 != mqu_parse_duration(arg, &args->timeout)) {
+			LOG_ERR("Invalid duration '%s' (e.g. 50ms, 2s)", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_TRANSPORT:
+		if (0 == strcmp("mq", arg)) args->transport = MQU_TRANSPORT_MQ;
+		else if (0 == strcmp("shm", arg)) args->transport = MQU_TRANSPORT_SHM;
+		else {
+			LOG_ERR("Invalid transport '%s' (use 'mq' or 'shm')", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_WAKEUP:
+		if (0 == strcmp("poll", arg)) args->wakeup = MQU_WAKEUP_POLL;
+		else if (0 == strcmp("notify", arg)) args->wakeup = MQU_WAKEUP_NOTIFY;
+		else if (0 == strcmp("blocking", arg)) args->wakeup = MQU_WAKEUP_BLOCKING;
+		else {
+			LOG_ERR("Invalid wakeup '%s' (use 'poll', 'notify' or 'blocking')", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
 	case 'f': args->follow = 1; break;
-	case 's': args->msgsize = atoi(arg); break;
-	case 'm': args->maxmsg = atoi(arg); break;
-	case 'p': args->priority = atoi(arg); break;
+	case 's':
+		if (0 != mqu_parse_long(arg, 1, INT_MAX, &value)) {
+			LOG_ERR("Invalid msgsize '%s'", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		args->msgsize = value;
+		args->msgsize_given = 1;
+		break;
+	case 'm':
+		if (0 != mqu_parse_long(arg, 1, INT_MAX, &value)) {
+			LOG_ERR("Invalid maxmsg '%s'", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		args->maxmsg = value;
+		args->maxmsg_given = 1;
+		break;
+	case OPT_MODE: {
+		char *end;
+		errno = 0;
+		value = strtol(arg, &end, 8);
+		if (errno || end == arg || *end || value < 0 || value > 07777) {
+			LOG_ERR("Invalid mode '%s', expected octal permissions such as 0600", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		args->mode = (mode_t)value;
+		break;
+	}
+	case OPT_AUTO: args->auto_size = 1; break;
+	case OPT_BUSY_POLL:
+		if (0 != mqu_parse_duration(arg, &args->busy_poll)) {
+			LOG_ERR("Invalid busy-poll duration '%s'", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_CPU:
+		args->ncpus = mqu_parse_cpus(arg, &args->cpus);
+		if (args->ncpus <= 0) {
+			LOG_ERR("Invalid CPU list '%s'", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_SCHED: {
+		const char *colon = strchr(arg, ':');
+		size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+		if (4 == len && 0 == strncmp(arg, "fifo", len)) args->sched_policy = SCHED_FIFO;
+		else if (2 == len && 0 == strncmp(arg, "rr", len)) args->sched_policy = SCHED_RR;
+		else if (5 == len && 0 == strncmp(arg, "other", len)) args->sched_policy = SCHED_OTHER;
+		else args->sched_policy = -1;
+		value = 0;
+		if (colon && 0 != mqu_parse_long(colon + 1, 0, INT_MAX, &value)) args->sched_policy = -1;
+		args->sched_priority = value;
+		if (-1 == args->sched_policy || (SCHED_OTHER == args->sched_policy) != !colon
+		    || args->sched_priority < sched_get_priority_min(args->sched_policy)
+		    || args->sched_priority > sched_get_priority_max(args->sched_policy)) {
+			LOG_ERR("Invalid scheduling '%s' (use 'fifo:PRIO', 'rr:PRIO' with PRIO in %d..%d, or 'other')",
+			        arg, sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	}
+	case OPT_MLOCK: args->mlock = 1; break;
+	case OPT_MATCH:
+		args->filter.prefix = arg;
+		args->filter.prefix_len = strlen(arg);
+		break;
+	case OPT_CONTAINS:
+		args->filter.text = arg;
+		args->filter.text_len = strlen(arg);
+		break;
+	case OPT_REGEX:
+		if (args->filter.regex) {
+			regfree(args->filter.regex);
+			free(args->filter.regex);
+		}
+		args->filter.regex = malloc(sizeof(*args->filter.regex));
+		if (!args->filter.regex || 0 != mqu_compile_regex(args->filter.regex, arg)) {
+			free(args->filter.regex);
+			args->filter.regex = NULL;
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_ROUTE: {
+		/* queue names start with '/', and the expression may contain ':' */
+		char *sep = NULL;
+		for (char *p = strstr(arg, ":/"); p; p = strstr(p + 1, ":/")) sep = p;
+		struct mqu_route *routes = realloc(args->routes, (args->nroutes + 1) * sizeof(*routes));
+		if (!sep || sep == arg || !sep[2] || !routes) {
+			if (routes) args->routes = routes;
+			LOG_ERR("Invalid route '%s' (use RE:QNAME)", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		args->routes = routes;
+		*sep = '\0';
+		if (0 != mqu_compile_regex(&routes[args->nroutes].regex, arg)) return ARGP_ERR_UNKNOWN;
+		routes[args->nroutes++].qname = sep + 1;
+		break;
+	}
+	case OPT_SAMPLE: args->sample_file = arg; break;
+	case 'p':
+		if (0 != mqu_parse_long(arg, 0, MQ_PRIO_MAX - 1, &value)) {
+			LOG_ERR("Invalid priority '%s' (from 0 to %d)", arg, MQ_PRIO_MAX - 1);
+			return ARGP_ERR_UNKNOWN;
+		}
+		args->priority = value;
+		break;
+	case OPT_STDIN: args->from_stdin = 1; break;
+	case OPT_PRINT_NAME: args->print_name = 1; break;
+	case OPT_PRINT_PRIORITY: args->print_priority = 1; break;
+	case OPT_WORKERS:
+		if (0 != mqu_parse_long(arg, 1, MQU_MAX_THREADS, &value)) {
+			LOG_ERR("Invalid number of workers '%s' (from 1 to %d)", arg, MQU_MAX_THREADS);
+			return ARGP_ERR_UNKNOWN;
+		}
+		args->workers = value;
+		break;
+	case OPT_ORDERED: args->ordered = 1; break;
+	case OPT_THREADS:
+		if (0 != mqu_parse_long(arg, 1, MQU_MAX_THREADS, &value)) {
+			LOG_ERR("Invalid number of threads '%s' (from 1 to %d)", arg, MQU_MAX_THREADS);
+			return ARGP_ERR_UNKNOWN;
+		}
+		args->threads = value;
+		break;
+	case OPT_RATE:
+		if (0 != mqu_parse_positive(arg, &args->rate)) {
+			LOG_ERR("Invalid rate '%s'", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_SPILL: args->spill_dir = arg; break;
+	case OPT_COMPRESS: {
+		static const char *codecs[] = { "none", "lz4", "zstd", "zlib" };
+		int codec;
+		for (codec=0; codec<MQU_CODECS; codec++) {
+			if (arg ? 0 == strcmp(codecs[codec], arg) : (codec && mqu_codec_available(codec))) break;
+		}
+		if (!arg && MQU_CODECS == codec) {
+			LOG_ERR("No codec is available in this build");
+			return ARGP_ERR_UNKNOWN;
+		}
+		if (MQU_CODECS == codec) {
+			LOG_ERR("Invalid codec '%s' (use 'lz4', 'zstd', 'zlib' or 'none')", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		if (!mqu_codec_available(codec)) {
+			LOG_ERR("The codec %s is not available in this build", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		args->compress = codec;
+		break;
+	}
+	case OPT_DICTIONARY: args->dictionary_file = arg; break;
+	case OPT_PACK: args->pack = 1; break;
+	case OPT_LINGER:
+		if (0 != mqu_parse_duration(arg, &args->linger)) {
+			LOG_ERR("Invalid duration '%s' (e.g. 50ms, 2s)", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_SPEED:
+		if (0 != mqu_parse_number(arg, &args->speed)) {
+			LOG_ERR("Invalid speed '%s', expected a factor, or 0 for as fast as possible", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_INTERVAL:
+		if (0 != mqu_parse_positive(arg, &args->interval)) {
+			LOG_ERR("Invalid interval '%s'", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_ALL: args->all = 1; break;
+	case OPT_MIN_PRIORITY:
+		if (0 != mqu_parse_long(arg, 0, MQ_PRIO_MAX - 1, &value)) {
+			LOG_ERR("Invalid priority '%s' (from 0 to %d)", arg, MQ_PRIO_MAX - 1);
+			return ARGP_ERR_UNKNOWN;
+		}
+		args->min_priority = value;
+		break;
+	case OPT_PRODUCERS:
+	case OPT_CONSUMERS:
+		if (0 != mqu_parse_long(arg, 1, MQU_MAX_THREADS, &value)) {
+			LOG_ERR("Invalid number of threads '%s' (from 1 to %d)", arg, MQU_MAX_THREADS);
+			return ARGP_ERR_UNKNOWN;
+		}
+		if (OPT_PRODUCERS == key) args->producers = value;
+		else args->consumers = value;
+		break;
+	case OPT_DURATION:
+		if (0 != mqu_parse_positive(arg, &args->duration)) {
+			LOG_ERR("Invalid duration '%s'", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_COUNT:
+		if (0 != mqu_parse_long(arg, 0, LONG_MAX, &value)) {
+			LOG_ERR("Invalid count '%s'", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		args->count = value;
+		break;
+	case OPT_PAYLOAD:
+		if (0 != mqu_parse_long(arg, 0, INT_MAX, &value)) {
+			LOG_ERR("Invalid payload size '%s'", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		args->payload = value;
+		break;
+	case OPT_SWEEP: args->sweep = 1; break;
+	case OPT_STATS:
+		args->stats = 1;
+		if (arg && 0 != mqu_parse_positive(arg, &args->stats_interval)) {
+			LOG_ERR("Invalid stats interval '%s', expected seconds greater than 0", arg);
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case OPT_STATS_FILE: args->stats_file = arg; break;
 	case 'd':
 		if (0 == strcmp("n", arg)) args->delimiter = '\n';
 		else if (0 == strcmp("z", arg)) args->delimiter = '\0';
@@ -159,8 +1004,16 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 
 	case ARGP_KEY_ARG:
 		if (!args->command) args->command = arg;
-		else if (!args->qname) args->qname = arg;
-		else if (0 == strcmp(args->command, "send") && !args->message) {
+		else if (0 == strcmp(args->command, "replay") && !args->file) args->file = arg;
+		else if (!args->qname) {
+			args->qname = arg;
+			args->qnames[args->qcount++] = arg;
+		} else if (0 == strcmp(args->command, "recv") || 0 == strcmp(args->command, "relay")
+		           || 0 == strcmp(args->command, "top") || 0 == strcmp(args->command, "info")) {
+			args->qnames[args->qcount++] = arg;
+		} else if (0 == strcmp(args->command, "record") && !args->file) {
+			args->file = arg;
+		} else if (0 == strcmp(args->command, "send") && !args->message && !args->from_stdin) {
 			args->message = arg;
 			args->msglen = strlen(arg);
 		} else {
@@ -171,8 +1024,94 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 
 	case ARGP_KEY_END:
 		if (!args->command) argp_usage(state);
-		if (!args->qname) argp_usage(state);
-		if (0 == strcmp(args->command, "send") && !args->message) argp_usage(state);
+		if (!args->qname && 0 != strcmp(args->command, "bench") && 0 != strcmp(args->command, "top")
+		    && !(args->all && 0 == strcmp(args->command, "info"))) {
+			argp_usage(state);
+		}
+		if (0 == strcmp(args->command, "send") && !args->message && !args->from_stdin) argp_usage(state);
+		if (0 == strcmp(args->command, "relay") && args->qcount < 2 && !args->nroutes) argp_usage(state);
+		if ((0 == strcmp(args->command, "record") || 0 == strcmp(args->command, "replay")) && !args->file) {
+			argp_usage(state);
+		}
+		if ((args->zero_copy || args->framing)
+		    && (args->timestamp || args->print_name || args->print_priority || MQU_FMT_RAW != args->format)) {
+			LOG_ERR("--zero-copy and --framing cannot be used with -t, --print-* or --format");
+			argp_usage(state);
+		}
+		int tabular = (0 == strcmp(args->command, "info") || 0 == strcmp(args->command, "bench"));
+		if (MQU_FMT_RAW != args->format && ((MQU_FMT_HEX < args->format) != tabular
+		    || (MQU_FMT_PROMETHEUS == args->format && 0 != strcmp(args->command, "info")))) {
+			LOG_ERR("This format cannot be used with %s (see formats)", args->command);
+			argp_usage(state);
+		}
+		if ((args->timeout >= 0 || args->count) && args->workers > 1) {
+			LOG_ERR("--timeout and --count cannot be used with --workers");
+			argp_usage(state);
+		}
+		if (MQU_TRANSPORT_SHM == args->transport
+		    && (0 == strcmp(args->command, "relay") || 0 == strcmp(args->command, "top")
+		        || 0 == strcmp(args->command, "record") || 0 == strcmp(args->command, "replay")
+		        || args->workers > 1 || args->threads > 1 || args->zero_copy || MQU_WAKEUP_AUTO != args->wakeup)) {
+			LOG_ERR("--transport=shm cannot be used with relay, top, record, replay, "
+			        "--workers, --threads, --zero-copy or --wakeup");
+			argp_usage(state);
+		}
+		if (args->spill_dir && (args->threads > 1 || args->timeout >= 0 || MQU_TRANSPORT_SHM == args->transport)) {
+			LOG_ERR("--spill cannot be used with --threads, --timeout or --transport=shm");
+			argp_usage(state);
+		}
+		if (args->sample_file && !args->auto_size) {
+			LOG_ERR("--sample requires --auto");
+			argp_usage(state);
+		}
+		if (args->auto_size && (MQU_TRANSPORT_SHM == args->transport || 0 != strcmp(args->command, "create"))) {
+			LOG_ERR("--auto can only be used with create, on message queues");
+			argp_usage(state);
+		}
+		if (args->pack && (args->threads > 1 || args->zero_copy || MQU_TRANSPORT_SHM == args->transport)) {
+			LOG_ERR("--pack cannot be used with --threads, --zero-copy or --transport=shm");
+			argp_usage(state);
+		}
+		if (args->compress >= 0 && MQU_TRANSPORT_SHM == args->transport) {
+			LOG_ERR("--compress cannot be used with --transport=shm");
+			argp_usage(state);
+		}
+		if (args->dictionary_file && (args->compress < 0 || MQU_CODEC_LZ4 == args->compress)) {
+			LOG_ERR("--dictionary requires --compress, with zstd or zlib");
+			argp_usage(state);
+		}
+		if (MQU_WAKEUP_AUTO != args->wakeup && args->workers > 1) {
+			LOG_ERR("--wakeup cannot be used with --workers");
+			argp_usage(state);
+		}
+		if (args->zero_copy && args->workers > 1) {
+			LOG_ERR("--zero-copy cannot be used with --workers");
+			argp_usage(state);
+		}
+		if ((args->filter.prefix || args->filter.text || args->filter.regex || args->nroutes)
+		    && 0 != strcmp(args->command, "recv") && 0 != strcmp(args->command, "relay")) {
+			LOG_ERR("--match, --contains, --regex and --route can only be used with recv or relay");
+			argp_usage(state);
+		}
+		if (args->nroutes && (!(args->follow || 0 == strcmp(args->command, "relay")) || args->workers > 1
+		                      || MQU_TRANSPORT_SHM == args->transport)) {
+			LOG_ERR("--route needs recv -f or relay, and cannot be used with --workers or --transport=shm");
+			argp_usage(state);
+		}
+		if ((args->busy_poll || args->ncpus || -1 != args->sched_policy || args->mlock)
+		    && 0 != strcmp(args->command, "relay") && !(args->follow && 0 == strcmp(args->command, "recv"))) {
+			LOG_ERR("--busy-poll, --cpu, --sched and --mlock can only be used with recv -f or relay");
+			argp_usage(state);
+		}
+		if (args->busy_poll && (args->workers > 1 || MQU_WAKEUP_BLOCKING == args->wakeup
+		                        || MQU_TRANSPORT_SHM == args->transport)) {
+			LOG_ERR("--busy-poll cannot be used with --workers, --wakeup=blocking or --transport=shm");
+			argp_usage(state);
+		}
+		if (args->zero_copy && args->framing) {
+			LOG_ERR("--zero-copy cannot be used with --framing");
+			argp_usage(state);
+		}
 		return ARGP_ERR_UNKNOWN;
 
 	default:
@@ -181,192 +1120,3484 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 	return 0;
 }
 
-static int cmd_create(const struct arguments *args)
+/* Send a message, giving up after --timeout if it is set
+ *
+ * Return 0 on success, -1 on error (ETIMEDOUT on timeout).
+ */
+static int mqu_send_timed(const struct arguments *args, mqd_t queue, const char *data, size_t len, unsigned prio)
 {
-	struct mq_attr attr;
-	attr.mq_flags = 0;
-	attr.mq_maxmsg = args->maxmsg;
-	attr.mq_msgsize = args->msgsize;
-	attr.mq_curmsgs = 0;
+	struct timespec deadline;
+	if (args->timeout >= 0) mqu_deadline(&deadline, args->timeout);
+	return mqu_send(queue, args->stats_data, data, len, prio, (args->timeout >= 0) ? &deadline : NULL);
+}
 
-	mode_t mode = 0644;
+/* Limits of the system on message queues */
+#define MQU_SYSCTL_DIR "/proc/sys/fs/mqueue/"
 
-	LOG_VERBOSE(args, "Opening mq %s (O_CREAT, O_RDWR, O_EXCL, %o)", args->qname, mode);
+/* Approximate memory charged to RLIMIT_MSGQUEUE by the kernel for each
+ * message (struct msg_msg), and for each priority used (tree node) */
+#define MQU_MSG_OVERHEAD 48
+#define MQU_PRIO_OVERHEAD 48
 
-	mqd_t queue = mq_open(args->qname, O_CREAT|O_RDWR|O_EXCL, mode, &attr);
+struct mqu_limits {
+	long msg_max;
+	long msgsize_max;
+	long queues_max;
+	struct rlimit rlimit; /* RLIMIT_MSGQUEUE */
+};
 
-	if (-1 == queue) {
-		LOG_ERR("mq_open error: %s", strerror(errno));
-		return 1;
-	}
-	return 0;
+static long mqu_read_sysctl(const char *name)
+{
+	char path[256];
+	long value = -1;
+
+	snprintf(path, sizeof(path), MQU_SYSCTL_DIR "%s", name);
+	FILE *f = fopen(path, "r");
+	if (!f) return -1;
+	if (1 != fscanf(f, "%ld", &value)) value = -1;
+	fclose(f);
+	return value;
 }
 
-static int cmd_info(const struct arguments *args)
+static void mqu_read_limits(struct mqu_limits *limits)
 {
-	struct mq_attr attr;
-	int ret;
+	limits->msg_max = mqu_read_sysctl("msg_max");
+	limits->msgsize_max = mqu_read_sysctl("msgsize_max");
+	limits->queues_max = mqu_read_sysctl("queues_max");
+	if (0 != getrlimit(RLIMIT_MSGQUEUE, &limits->rlimit)) {
+		limits->rlimit.rlim_cur = RLIM_INFINITY;
+		limits->rlimit.rlim_max = RLIM_INFINITY;
+	}
+}
+
+/* Bytes of RLIMIT_MSGQUEUE used by a queue */
+static uint64_t mqu_queue_bytes(long maxmsg, long msgsize)
+{
+	long prios = (maxmsg < MQ_PRIO_MAX) ? maxmsg : MQ_PRIO_MAX;
+	return (uint64_t)maxmsg * (msgsize + MQU_MSG_OVERHEAD) + (uint64_t)prios * MQU_PRIO_OVERHEAD;
+}
+
+/* Tell which limit made the creation of a queue fail */
+static void mqu_explain_limits(int error, long maxmsg, long msgsize)
+{
+	struct mqu_limits limits;
+
+	mqu_read_limits(&limits);
+	if (EINVAL == error && limits.msg_max > 0 && maxmsg > limits.msg_max) {
+		LOG_ERR("maxmsg %ld is more than %ld (" MQU_SYSCTL_DIR "msg_max)", maxmsg, limits.msg_max);
+	}
+	if (EINVAL == error && limits.msgsize_max > 0 && msgsize > limits.msgsize_max) {
+		LOG_ERR("msgsize %ld is more than %ld (" MQU_SYSCTL_DIR "msgsize_max)", msgsize, limits.msgsize_max);
+	}
+	if (EMFILE == error && RLIM_INFINITY != limits.rlimit.rlim_cur) {
+		LOG_ERR("The queue needs about %llu bytes, RLIMIT_MSGQUEUE is %llu for all the queues of the user "
+		        "(see create --auto)", (unsigned long long)mqu_queue_bytes(maxmsg, msgsize),
+		        (unsigned long long)limits.rlimit.rlim_cur);
+	}
+	if (ENOSPC == error && limits.queues_max > 0) {
+		LOG_ERR("There are already %ld queues (" MQU_SYSCTL_DIR "queues_max)", limits.queues_max);
+	}
+}
+
+static mqd_t mqu_create(const struct arguments *args, const char *qname, int oflag)
+{
+	struct mq_attr attr;
+	attr.mq_flags = 0;
+	attr.mq_maxmsg = args->maxmsg;
+	attr.mq_msgsize = args->msgsize;
+	attr.mq_curmsgs = 0;
+
+	mode_t mode = 0644;
+
+	LOG_VERBOSE(args, "Opening mq %s (O_CREAT, %s, O_EXCL, %o)", qname,
+	            (O_WRONLY == oflag) ? "O_WRONLY" : "O_RDWR", mode);
+
+	mqd_t queue = mq_open(qname, O_CREAT|O_EXCL|oflag, mode, &attr);
 
-	LOG_VERBOSE(args, "Opening mq %s (O_RDONLY)", args->qname);
-	mqd_t queue = mq_open(args->qname, O_RDONLY);
 	if (-1 == queue) {
 		LOG_ERR("mq_open error: %s", strerror(errno));
+		mqu_explain_limits(errno, attr.mq_maxmsg, attr.mq_msgsize);
+	}
+	return queue;
+}
+
+static struct mqu_shm *mqu_open_shm(const struct arguments *args, const char *qname, int oflag)
+{
+	struct mq_attr attr;
+	attr.mq_flags = 0;
+	attr.mq_maxmsg = args->maxmsg;
+	attr.mq_msgsize = args->msgsize;
+	attr.mq_curmsgs = 0;
+
+	LOG_VERBOSE(args, "Opening shm queue %s%s", qname, (oflag & O_CREAT) ? " (O_CREAT, O_EXCL)" : "");
+	struct mqu_shm *shm = mqu_shm_open(qname, oflag, args->mode, &attr);
+	if (!shm) LOG_ERR("shm_open error on %s: %s", qname, strerror(errno));
+	return shm;
+}
+
+/* Bytes of RLIMIT_MSGQUEUE used by the other queues of the user */
+static uint64_t mqu_user_queue_bytes(const char *except)
+{
+	uint64_t total = 0;
+	struct dirent *entry;
+	DIR *dir = opendir(MQ_DIR);
+	if (!dir) return 0;
+
+	while (NULL != (entry = readdir(dir))) {
+		char qname[NAME_MAX + 2];
+		struct mq_attr attr;
+		struct stat st;
+		char path[sizeof(MQ_DIR) + NAME_MAX + 1];
+
+		if ('.' == entry->d_name[0]) continue;
+		snprintf(path, sizeof(path), MQ_DIR "/%s", entry->d_name);
+		snprintf(qname, sizeof(qname), "/%s", entry->d_name);
+		if (0 == strcmp(qname, except) || 0 != stat(path, &st) || st.st_uid != getuid()) continue;
+		mqd_t queue = mq_open(qname, O_RDONLY|O_NONBLOCK);
+		if (-1 == queue) continue;
+		if (0 == mq_getattr(queue, &attr)) total += mqu_queue_bytes(attr.mq_maxmsg, attr.mq_msgsize);
+		mq_close(queue);
+	}
+	closedir(dir);
+	return total;
+}
+
+/* Get the size of the largest message in the last statistics of a file
+ *
+ * Return 0 on success, -1 if the file has no message sizes.
+ */
+static int mqu_read_sample(const char *path, long *max_bytes, unsigned long long *eagain)
+{
+	char line[4096];
+	int found = -1;
+	FILE *f = fopen(path, "r");
+	if (!f) return -1;
+
+	/* statistics are cumulated, so the last line with messages has it all */
+	while (fgets(line, sizeof(line), f)) {
+		const char *op = strstr(line, "\"send\":{");
+		if (!op) op = strstr(line, "\"recv\":{");
+		const char *max = op ? strstr(op, "\"max_bytes\":") : NULL;
+		const char *full = op ? strstr(op, "\"eagain\":") : NULL;
+		if (!max) continue;
+		*max_bytes = atol(max + strlen("\"max_bytes\":"));
+		*eagain = full ? strtoull(full + strlen("\"eagain\":"), NULL, 10) : 0;
+		found = 0;
+	}
+	fclose(f);
+	return found;
+}
+
+/* Choose maxmsg and msgsize for create --auto
+ *
+ * Return 0 on success, -1 if no size fits the limits.
+ */
+static int mqu_auto_size(struct arguments *args)
+{
+	struct mqu_limits limits;
+	unsigned long long eagain = 0;
+
+	mqu_read_limits(&limits);
+
+	if (!args->msgsize_given && args->sample_file) {
+		long max_bytes;
+		if (0 != mqu_read_sample(args->sample_file, &max_bytes, &eagain)) {
+			LOG_ERR("No message sizes in %s (see --stats)", args->sample_file);
+			return -1;
+		}
+		/* room to grow, as the sample may not have the largest messages */
+		args->msgsize = (max_bytes > 0) ? max_bytes + max_bytes / 4 : 1;
+		LOG_VERBOSE(args, "Largest message of the sample: %ld bytes, full queue: %llu times", max_bytes, eagain);
+	}
+	if (limits.msgsize_max > 0 && args->msgsize > limits.msgsize_max) {
+		if (args->msgsize_given) {
+			LOG_ERR("msgsize %d is more than %ld (" MQU_SYSCTL_DIR "msgsize_max)", args->msgsize, limits.msgsize_max);
+			return -1;
+		}
+		args->msgsize = limits.msgsize_max;
+	}
+
+	uint64_t used = mqu_user_queue_bytes(args->qname);
+	uint64_t soft = limits.rlimit.rlim_cur;
+	uint64_t hard = limits.rlimit.rlim_max;
+	uint64_t budget = (RLIM_INFINITY == limits.rlimit.rlim_cur) ? UINT64_MAX : (soft > used ? soft - used : 0);
+	long maxmsg = (limits.msg_max > 0) ? limits.msg_max : args->maxmsg;
+	if (args->maxmsg_given) {
+		if (args->maxmsg > maxmsg) {
+			LOG_ERR("maxmsg %d is more than %ld (" MQU_SYSCTL_DIR "msg_max)", args->maxmsg, maxmsg);
+			return -1;
+		}
+		maxmsg = args->maxmsg;
+		/* raise the soft limit for this queue, which is checked in mq_open */
+		uint64_t needed = used + mqu_queue_bytes(maxmsg, args->msgsize);
+		if (RLIM_INFINITY != limits.rlimit.rlim_cur && needed > soft) {
+			if (RLIM_INFINITY != limits.rlimit.rlim_max && needed > hard) {
+				LOG_ERR("The queues of the user would need %llu bytes, more than RLIMIT_MSGQUEUE (hard limit %llu)",
+				        (unsigned long long)needed, (unsigned long long)hard);
+				return -1;
+			}
+			struct rlimit raised = { needed, limits.rlimit.rlim_max };
+			if (0 != setrlimit(RLIMIT_MSGQUEUE, &raised)) {
+				LOG_ERR("Cannot raise RLIMIT_MSGQUEUE to %llu: %s", (unsigned long long)needed, strerror(errno));
+				return -1;
+			}
+			LOG_VERBOSE(args, "Raised RLIMIT_MSGQUEUE from %llu to %llu",
+			            (unsigned long long)soft, (unsigned long long)needed);
+			budget = needed - used;
+		}
+	} else {
+		while (maxmsg > 1 && mqu_queue_bytes(maxmsg, args->msgsize) > budget) maxmsg--;
+		if (eagain && maxmsg <= args->maxmsg) {
+			LOG_ERR("The queue of the sample was full %llu times, and cannot be made deeper than %ld", eagain, maxmsg);
+		}
+	}
+	if (mqu_queue_bytes(maxmsg, args->msgsize) > budget) {
+		LOG_ERR("A queue of msgsize %d needs %llu bytes, %llu are left of RLIMIT_MSGQUEUE", args->msgsize,
+		        (unsigned long long)mqu_queue_bytes(1, args->msgsize), (unsigned long long)budget);
+		return -1;
+	}
+	args->maxmsg = maxmsg;
+
+	printf("%s: maxmsg=%d, msgsize=%d, bytes=%llu, used=%llu, rlimit=", args->qname, args->maxmsg, args->msgsize,
+	       (unsigned long long)mqu_queue_bytes(args->maxmsg, args->msgsize), (unsigned long long)used);
+	if (RLIM_INFINITY == limits.rlimit.rlim_cur) printf("unlimited\n");
+	else printf("%llu\n", (unsigned long long)(used + budget > soft ? used + budget : soft));
+	return 0;
+}
+
+static int cmd_create(const struct arguments *args_in)
+{
+	struct arguments sized = *args_in;
+	const struct arguments *args = &sized;
+	if (sized.auto_size && 0 != mqu_auto_size(&sized)) return 1;
+
+	if (MQU_TRANSPORT_SHM == args->transport) {
+		struct mqu_shm *shm = mqu_open_shm(args, args->qname, O_CREAT|O_EXCL);
+		if (!shm) return 1;
+		mqu_shm_close(shm);
+		return 0;
+	}
+
+	mqd_t queue = mqu_create(args, args->qname, O_RDWR);
+	if (-1 == queue) return 1;
+
+	mq_close(queue);
+	return 0;
+}
+
+static int cmd_unlink(const struct arguments *args)
+{
+	int shm = (MQU_TRANSPORT_SHM == args->transport);
+	LOG_VERBOSE(args, "Deleting %s %s", shm ? "shm queue" : "mq", args->qname);
+	int ret = shm ? mqu_shm_unlink(args->qname) : mq_unlink(args->qname);
+
+	if (0 != ret) {
+		LOG_ERR("%s error: %s", shm ? "shm_unlink" : "mq_unlink", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static mqd_t mqu_open_wo(const struct arguments *args, const char *qname)
+{
+	mqd_t queue;
+	int oflag = O_WRONLY;
+	if (!args->blocking) oflag |= O_NONBLOCK;
+
+	LOG_VERBOSE(args, "Opening mq %s (O_WRONLY%s)",
+	            qname, (oflag & O_NONBLOCK)?", O_NONBLOCK":"");
+
+	queue = mq_open(qname, oflag);
+	if (-1 == queue) LOG_ERR("mq_open error: %s", strerror(errno));
+
+	return queue;
+}
+
+/* Reader that splits an input stream into delimited or framed records */
+struct mqu_reader {
+	int fd;
+	char delimiter;
+	int framing; /* MQU_FRAMING_... */
+	uint8_t *buffer;
+	size_t size;  /* allocated size of buffer */
+	size_t start; /* offset of the first unconsumed byte */
+	size_t end;   /* offset after the last byte read */
+	size_t maxlen; /* maximum length of a record */
+	int eof;
+	int64_t deadline; /* of CLOCK_MONOTONIC in nanoseconds, to stop waiting for input, or -1 */
+};
+
+static int mqu_reader_init(struct mqu_reader *reader, int fd, char delimiter, int framing, size_t maxlen)
+{
+	reader->fd = fd;
+	reader->delimiter = delimiter;
+	reader->framing = framing;
+	reader->maxlen = maxlen;
+	/* room for a full record plus its delimiter or header, and large reads */
+	reader->size = maxlen + MQU_FRAME_HEADER_MAX + 65536;
+	reader->buffer = malloc(reader->size);
+	reader->start = 0;
+	reader->end = 0;
+	reader->eof = 0;
+	reader->deadline = -1;
+	if (!reader->buffer) return -1;
+	return 0;
+}
+
+static void mqu_reader_free(struct mqu_reader *reader)
+{
+	free(reader->buffer);
+	reader->buffer = NULL;
+}
+
+/* Get the next record
+ *
+ * On success, *record points into the internal buffer and remains
+ * valid until the next call. For framed records, *prio is set to the
+ * priority of the record, otherwise it is left unchanged.
+ *
+ * Return 1 if a record was found, 0 at end of input, -1 on error, and 2
+ * if no complete record was read before reader->deadline.
+ */
+static int mqu_read_record(struct mqu_reader *reader, uint8_t **record, size_t *len, unsigned *prio)
+{
+	while (1) {
+		uint8_t *data = reader->buffer + reader->start;
+		size_t avail = reader->end - reader->start;
+
+		if (reader->framing) {
+			size_t length;
+			unsigned priority;
+			int header = mqu_parse_frame(data, avail, reader->framing, &length, &priority);
+			if (header < 0) {
+				LOG_ERR("Invalid record header");
+				return -1;
+			}
+			if (header > 0 && length > reader->maxlen) {
+				LOG_ERR("Message too long (%zu bytes, more than %zu)", length, reader->maxlen);
+				return -1;
+			}
+			if (header > 0 && avail - header >= length) {
+				*record = data + header;
+				*len = length;
+				*prio = priority;
+				reader->start += header + length;
+				break;
+			}
+			if (reader->eof) {
+				if (0 == avail) return 0;
+				LOG_ERR("Truncated record at end of input");
+				return -1;
+			}
+		} else {
+			uint8_t *delim = memchr(data, reader->delimiter, avail);
+
+			if (delim) {
+				*record = data;
+				*len = delim - data;
+				reader->start += *len + 1;
+				break;
+			}
+
+			if (avail > reader->maxlen) {
+				LOG_ERR("Message too long (more than %zu bytes)", reader->maxlen);
+				return -1;
+			}
+
+			if (reader->eof) {
+				if (0 == avail) return 0;
+				/* last record, not terminated by a delimiter */
+				*record = data;
+				*len = avail;
+				reader->start = reader->end;
+				break;
+			}
+		}
+
+		/* move the partial record at the beginning of the buffer */
+		if (reader->start > 0) {
+			memmove(reader->buffer, data, avail);
+			reader->start = 0;
+			reader->end = avail;
+		}
+
+		if (reader->deadline >= 0) {
+			struct pollfd pfd = { .fd = reader->fd, .events = POLLIN };
+			int64_t wait = reader->deadline - (int64_t)mqu_now_ns();
+			struct timespec timeout = { 0, 0 };
+			if (wait > 0) {
+				timeout.tv_sec = wait / 1000000000;
+				timeout.tv_nsec = wait % 1000000000;
+			}
+			int rv = ppoll(&pfd, 1, &timeout, NULL);
+			if (rv < 0 && EINTR == errno) continue;
+			if (0 == rv) return 2;
+		}
+
+		ssize_t n = read(reader->fd, reader->buffer + reader->end, reader->size - reader->end);
+		if (n < 0) {
+			if (EINTR == errno) continue;
+			LOG_ERR("read error: %s", strerror(errno));
+			return -1;
+		}
+		if (0 == n) reader->eof = 1;
+		reader->end += n;
+	}
+	return 1;
+}
+
+/* Contexts and buffer of --compress, for one thread */
+struct mqu_compression {
+	struct mqu_codec *codec; /* NULL without --compress */
+	uint8_t *buffer;
+	size_t size;
+};
+
+static void mqu_compression_free(struct mqu_compression *c)
+{
+	mqu_codec_free(c->codec);
+	c->codec = NULL;
+	free(c->buffer);
+	c->buffer = NULL;
+}
+
+/* Prepare to compress or decompress messages of up to msgsize bytes
+ *
+ * Return 0 on success (also without --compress), -1 on error.
+ */
+static int mqu_compression_init(const struct arguments *args, struct mqu_compression *c, size_t msgsize)
+{
+	c->codec = NULL;
+	c->buffer = NULL;
+	c->size = 0;
+	if (args->compress < 0) return 0;
+
+	c->codec = mqu_codec_new(args->compress, 0, args->dictionary, args->dictionary_len);
+	c->size = msgsize + 1; /* room for the header byte */
+	c->buffer = malloc(c->size);
+	if (!c->codec || !c->buffer) {
+		LOG_ERR("Cannot create the compression contexts: %s", strerror(errno));
+		mqu_compression_free(c);
+		return -1;
+	}
+	return 0;
+}
+
+/* Compress a message to send, if it is up to msgsize bytes
+ *
+ * Return the size to send, or -1 (EMSGSIZE) if the message does not fit
+ * in msgsize once marked as not compressed: a message of msgsize bytes
+ * that does not compress, and starts like a compressed message.
+ */
+static ssize_t mqu_encode(struct mqu_compression *c, const char **data, size_t len)
+{
+	const void *result;
+
+	if (!c->codec || len >= c->size) return len;
+	size_t n = mqu_compress(c->codec, *data, len, c->buffer, &result);
+	if (n >= c->size) {
+		LOG_ERR("A message of %zu bytes starting with byte 0x%02x does not compress, and must be shorter "
+		        "than msgsize to be marked as not compressed", len, (uint8_t)(*data)[0]);
+		errno = EMSGSIZE;
+		return -1;
+	}
+	*data = result;
+	return n;
+}
+
+/* Output stage that packs several messages in one write
+ *
+ * A writer with a negative fd only accumulates data in memory,
+ * growing its buffer as needed.
+ */
+struct mqu_writer {
+	int fd;
+	uint8_t *buffer;
+	size_t size;  /* allocated size of buffer */
+	size_t len;   /* number of bytes pending */
+	struct timespec since; /* time of the oldest pending byte */
+
+	/* Zero-copy output to a pipe: messages are received in a ring of
+	 * page-aligned slots that are mapped into the pipe with vmsplice.
+	 * The pipe references the pages until they are read, so a slot is
+	 * only reused once the pipe is drained past it; until then the
+	 * messages are received in the normal buffer and copied. */
+	uint8_t *ring;
+	size_t slot_size;
+	int slots;
+	int slot; /* current slot */
+	uint64_t *slot_end; /* bytes put in the pipe once each slot was */
+	uint64_t piped; /* bytes put in the pipe */
+	uint64_t drained; /* bytes read from the pipe, when last checked */
+
+	struct mqu_compression compression; /* to decompress the messages */
+};
+
+#define MQU_WRITER_SIZE 65536
+#define MQU_WRITER_LATENCY_MS 10 /* max time data may wait in the buffer */
+
+static int mqu_writer_init(struct mqu_writer *writer, int fd)
+{
+	writer->fd = fd;
+	writer->size = MQU_WRITER_SIZE;
+	writer->len = 0;
+	writer->ring = NULL;
+	writer->slot_end = NULL;
+	writer->compression.codec = NULL;
+	writer->compression.buffer = NULL;
+	writer->buffer = malloc(writer->size);
+	if (!writer->buffer) return -1;
+	return 0;
+}
+
+/* Switch to zero-copy output for messages of up to msgsize bytes as
+ * received, after mqu_writer_enable_decompress
+ *
+ * Return 1 if enabled, 0 if the output is not a pipe (or vmsplice is not
+ * available) and normal writes are kept, -1 on error.
+ */
+static int mqu_writer_enable_splice(struct mqu_writer *writer, size_t msgsize)
+{
+#ifdef HAVE_VMSPLICE
+	struct stat st;
+	size_t page = sysconf(_SC_PAGESIZE);
+	int pipe_size;
+
+	if (0 != fstat(writer->fd, &st) || !S_ISFIFO(st.st_mode)) return 0;
+	pipe_size = fcntl(writer->fd, F_GETPIPE_SZ);
+	if (pipe_size < 0) return 0;
+
+	/* decompressed messages are copied to the slots, and may be larger */
+	if (writer->compression.codec && writer->compression.size > msgsize) msgsize = writer->compression.size;
+
+	/* room for the delimiter after the message */
+	writer->slot_size = (msgsize + 1 + page - 1) / page * page;
+	writer->slots = pipe_size / page + 1;
+	writer->slot_end = calloc(writer->slots, sizeof(*writer->slot_end));
+	if (!writer->slot_end
+	    || 0 != posix_memalign((void **)&writer->ring, page, writer->slot_size * writer->slots)) {
+		free(writer->slot_end);
+		writer->slot_end = NULL;
+		writer->ring = NULL;
+		LOG_ERR("Cannot allocate memory");
+		return -1;
+	}
+	writer->slot = 0;
+	writer->piped = 0;
+	writer->drained = 0;
+	return 1;
+#else
+	(void)writer;
+	(void)msgsize;
+	return 0;
+#endif
+}
+
+/* Decompress the messages of up to msgsize bytes before formatting them, with --compress
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int mqu_writer_enable_decompress(const struct arguments *args, struct mqu_writer *writer, size_t msgsize)
+{
+	if (writer->compression.codec && writer->compression.size > msgsize) return 0;
+	mqu_compression_free(&writer->compression);
+	return mqu_compression_init(args, &writer->compression, msgsize);
+}
+
+#ifdef HAVE_VMSPLICE
+/* Tell whether the pipe has been drained past the current slot */
+static int mqu_writer_slot_free(struct mqu_writer *writer)
+{
+	uint64_t end = writer->slot_end[writer->slot];
+	int unread;
+
+	if (end <= writer->drained) return 1;
+	if (0 != ioctl(writer->fd, FIONREAD, &unread) || unread < 0) return 0;
+	/* other writers of the pipe only make this more conservative */
+	writer->drained = ((uint64_t)unread < writer->piped) ? writer->piped - unread : 0;
+	return end <= writer->drained;
+}
+#endif
+
+/* Buffer where the next message should be received */
+static uint8_t *mqu_writer_recv_buffer(struct mqu_writer *writer, uint8_t *buffer)
+{
+#ifdef HAVE_VMSPLICE
+	if (writer->ring && mqu_writer_slot_free(writer)) return writer->ring + writer->slot * writer->slot_size;
+#else
+	(void)writer;
+#endif
+	return buffer;
+}
+
+static void mqu_writer_free(struct mqu_writer *writer)
+{
+	free(writer->buffer);
+	writer->buffer = NULL;
+	free(writer->ring);
+	writer->ring = NULL;
+	free(writer->slot_end);
+	writer->slot_end = NULL;
+	mqu_compression_free(&writer->compression);
+}
+
+/* Write all the data of the iovec, resuming after partial writes */
+static int mqu_writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (EINTR == errno) continue;
+			LOG_ERR("write error: %s", strerror(errno));
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static int mqu_writer_flush(struct mqu_writer *writer)
+{
+	struct iovec iov;
+
+	if (0 == writer->len || writer->fd < 0) return 0;
+
+	iov.iov_base = writer->buffer;
+	iov.iov_len = writer->len;
+	writer->len = 0;
+	return mqu_writev_full(writer->fd, &iov, 1);
+}
+
+/* Make room for len more bytes in a memory writer */
+static int mqu_writer_grow(struct mqu_writer *writer, size_t len)
+{
+	if (writer->len + len <= writer->size) return 0;
+
+	size_t size = writer->size * 2;
+	if (size < writer->len + len) size = writer->len + len;
+	uint8_t *buffer = realloc(writer->buffer, size);
+	if (!buffer) {
+		LOG_ERR("Cannot allocate memory");
+		return -1;
+	}
+	writer->buffer = buffer;
+	writer->size = size;
+	return 0;
+}
+
+/* Queue the concatenation of the iovec
+ *
+ * Data that does not fit in the buffer is written directly.
+ */
+static int mqu_writer_putv(struct mqu_writer *writer, struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	for (int i=0; i<iovcnt; i++) total += iov[i].iov_len;
+
+	if (writer->fd < 0) {
+		if (0 != mqu_writer_grow(writer, total)) return -1;
+	} else if (writer->len + total > writer->size) {
+		if (0 != mqu_writer_flush(writer)) return -1;
+	}
+
+	if (total > writer->size) return mqu_writev_full(writer->fd, iov, iovcnt);
+
+	if (0 == writer->len) clock_gettime(CLOCK_MONOTONIC, &writer->since);
+	for (int i=0; i<iovcnt; i++) {
+		memcpy(writer->buffer + writer->len, iov[i].iov_base, iov[i].iov_len);
+		writer->len += iov[i].iov_len;
+	}
+	return 0;
+}
+
+#ifdef HAVE_VMSPLICE
+/* Map the current slot, holding a message of len bytes, into the pipe
+ *
+ * A message received elsewhere is copied to the slot if the slot is
+ * free, or else written.
+ */
+static int mqu_writer_splice(struct mqu_writer *writer, const uint8_t *data, size_t len, char delimiter)
+{
+	uint8_t *slot = writer->ring + writer->slot * writer->slot_size;
+	struct iovec iov;
+
+	if (data != slot && (len + 1 > writer->slot_size || !mqu_writer_slot_free(writer))) {
+		struct iovec parts[2] = { { (void *)data, len }, { &delimiter, 1 } };
+		if (0 != mqu_writev_full(writer->fd, parts, 2)) return -1;
+		writer->piped += len + 1;
+		return 0;
+	}
+	if (data != slot) memcpy(slot, data, len);
+	slot[len] = delimiter;
+
+	iov.iov_base = slot;
+	iov.iov_len = len + 1;
+	while (iov.iov_len > 0) {
+		/* not SPLICE_F_GIFT: the slot is written again once read */
+		ssize_t n = vmsplice(writer->fd, &iov, 1, 0);
+		if (n < 0) {
+			if (EINTR == errno) continue;
+			LOG_ERR("vmsplice error: %s", strerror(errno));
+			return -1;
+		}
+		iov.iov_base = (uint8_t *)iov.iov_base + n;
+		iov.iov_len -= n;
+	}
+
+	writer->piped += len + 1;
+	writer->slot_end[writer->slot] = writer->piped;
+	writer->slot = (writer->slot + 1) % writer->slots;
+	return 0;
+}
+#endif
+
+/* Queue the hexadecimal encoding of the data */
+static int mqu_writer_put_hex(struct mqu_writer *writer, const uint8_t *data, size_t len)
+{
+	if (writer->fd < 0 && 0 != mqu_writer_grow(writer, 2*len)) return -1;
+
+	while (len > 0) {
+		if (writer->size - writer->len < 32) {
+			if (0 != mqu_writer_flush(writer)) return -1;
+		}
+		size_t n = (writer->size - writer->len) / 2;
+		if (n > len) n = len;
+
+		if (0 == writer->len) clock_gettime(CLOCK_MONOTONIC, &writer->since);
+		mqu_hex_encode((char *)writer->buffer + writer->len, data, n);
+		writer->len += 2*n;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Return 1 if the pending data has waited too long */
+static int mqu_writer_expired(const struct mqu_writer *writer)
+{
+	struct timespec now;
+	long elapsed_ms;
+
+	if (0 == writer->len) return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_ms = (now.tv_sec - writer->since.tv_sec) * 1000
+	             + (now.tv_nsec - writer->since.tv_nsec) / 1000000;
+	return elapsed_ms >= MQU_WRITER_LATENCY_MS;
+}
+
+/* Message passed between threads */
+struct mqu_record {
+	uint64_t seq; /* order of arrival, with recv --ordered */
+	unsigned prio;
+	size_t len;
+	uint8_t data[];
+};
+
+/* Record telling the consumer of a ring that a producer stopped */
+static struct mqu_record mqu_end_record;
+
+/* Bounded multi-producer multi-consumer ring of records
+ *
+ * The semaphores count the free and filled slots, so that each side
+ * claims a slot with an atomic increment, and sleeps only when the
+ * ring is full or empty. A slot may still be in use by a slower thread
+ * of the other side when it is claimed, so records are stored with a
+ * compare-and-swap and taken with an exchange.
+ */
+struct mqu_ring {
+	_Atomic(struct mqu_record *) *slots;
+	size_t mask;
+	atomic_size_t tail; /* next slot claimed by a producer */
+	atomic_size_t head; /* next slot claimed by a consumer */
+	sem_t free;
+	sem_t filled;
+};
+
+#define MQU_RING_SIZE 1024 /* must be a power of 2 */
+
+static int mqu_ring_init(struct mqu_ring *ring)
+{
+	ring->slots = calloc(MQU_RING_SIZE, sizeof(*ring->slots));
+	if (!ring->slots) return -1;
+	for (int i=0; i<MQU_RING_SIZE; i++) atomic_init(&ring->slots[i], NULL);
+	ring->mask = MQU_RING_SIZE - 1;
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->head, 0);
+	sem_init(&ring->free, 0, MQU_RING_SIZE);
+	sem_init(&ring->filled, 0, 0);
+	return 0;
+}
+
+static void mqu_ring_push(struct mqu_ring *ring, struct mqu_record *record)
+{
+	while (0 != sem_wait(&ring->free));
+	size_t pos = atomic_fetch_add_explicit(&ring->tail, 1, memory_order_relaxed);
+	_Atomic(struct mqu_record *) *slot = &ring->slots[pos & ring->mask];
+	struct mqu_record *empty = NULL;
+	while (!atomic_compare_exchange_weak_explicit(slot, &empty, record,
+	                                              memory_order_release, memory_order_relaxed)) {
+		empty = NULL;
+		sched_yield();
+	}
+	sem_post(&ring->filled);
+}
+
+/* Take the record of the next slot, once it is counted as filled */
+static struct mqu_record *mqu_ring_take(struct mqu_ring *ring)
+{
+	size_t pos = atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
+	_Atomic(struct mqu_record *) *slot = &ring->slots[pos & ring->mask];
+	struct mqu_record *record;
+
+	/* the producer of this slot may not have stored its record yet */
+	while (!(record = atomic_exchange_explicit(slot, NULL, memory_order_acquire))) sched_yield();
+	sem_post(&ring->free);
+	return record;
+}
+
+/* Return 1 and the next record, or 0 if the ring is empty */
+static int mqu_ring_trypop(struct mqu_ring *ring, struct mqu_record **record)
+{
+	if (0 != sem_trywait(&ring->filled)) return 0;
+	*record = mqu_ring_take(ring);
+	return 1;
+}
+
+static struct mqu_record *mqu_ring_pop(struct mqu_ring *ring)
+{
+	while (0 != sem_wait(&ring->filled));
+	return mqu_ring_take(ring);
+}
+
+static void mqu_ring_free(struct mqu_ring *ring)
+{
+	sem_destroy(&ring->free);
+	sem_destroy(&ring->filled);
+	free(ring->slots);
+}
+
+/* Token bucket limiting the rate of messages */
+struct mqu_rate {
+	double rate;   /* tokens per second */
+	double burst;  /* maximum number of tokens */
+	double tokens;
+	uint64_t last; /* time of the last refill */
+};
+
+static void mqu_rate_init(struct mqu_rate *bucket, double rate)
+{
+	bucket->rate = rate;
+	/* allow bursts of 10 ms */
+	bucket->burst = rate / 100 > 1 ? rate / 100 : 1;
+	bucket->tokens = bucket->burst;
+	bucket->last = mqu_now_ns();
+}
+
+/* Wait until a token is available, and take it */
+static void mqu_rate_wait(struct mqu_rate *bucket)
+{
+	while (1) {
+		uint64_t now = mqu_now_ns();
+		bucket->tokens += (now - bucket->last) * bucket->rate / 1e9;
+		if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+		bucket->last = now;
+		if (bucket->tokens >= 1) break;
+
+		double wait = (1 - bucket->tokens) / bucket->rate;
+		struct timespec ts;
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+	}
+	bucket->tokens -= 1;
+}
+
+/* State shared by the threads of send --stdin --threads */
+struct mqu_senders {
+	const struct arguments *args;
+	struct mqu_ring ring;
+	atomic_int error;
+};
+
+/* Send the records of the ring, until an end record */
+static void *mqu_sender_run(void *arg)
+{
+	struct mqu_senders *senders = arg;
+	const struct arguments *args = senders->args;
+	struct mqu_compression compression;
+	struct mqu_record *record;
+	struct mq_attr attr;
+	mqd_t queue;
+
+	queue = mqu_open_wo(args, args->qname);
+	if (-1 == queue || 0 != mq_getattr(queue, &attr)
+	    || 0 != mqu_compression_init(args, &compression, attr.mq_msgsize)) {
+		compression.codec = NULL;
+		compression.buffer = NULL;
+		atomic_store(&senders->error, 1);
+	}
+
+	while (&mqu_end_record != (record = mqu_ring_pop(&senders->ring))) {
+		/* after an error, keep consuming so that the reader does not block */
+		if (!atomic_load_explicit(&senders->error, memory_order_relaxed)) {
+			const char *data = (const char *)record->data;
+			ssize_t len = mqu_encode(&compression, &data, record->len);
+			if (len < 0) {
+				atomic_store(&senders->error, 1);
+			} else if (0 != mqu_send_timed(args, queue, data, len, record->prio)) {
+				LOG_ERR("mq_send error: %s", strerror(errno));
+				atomic_store(&senders->error, 1);
+			}
+		}
+		free(record);
+	}
+
+	mqu_compression_free(&compression);
+	if (-1 != queue) mq_close(queue);
+	return NULL;
+}
+
+/* Read the records in this thread, and send them from several threads */
+static int mqu_send_threads(const struct arguments *args, struct mqu_reader *reader, struct mqu_rate *bucket)
+{
+	struct mqu_senders senders;
+	pthread_t *threads;
+	uint8_t *data;
+	size_t len;
+	int started;
+	int ret;
+
+	senders.args = args;
+	atomic_init(&senders.error, 0);
+	threads = calloc(args->threads, sizeof(*threads));
+	if (!threads || 0 != mqu_ring_init(&senders.ring)) {
+		LOG_ERR("Cannot allocate memory");
+		free(threads);
+		return 1;
+	}
+
+	for (started=0; started<args->threads; started++) {
+		if (0 != pthread_create(&threads[started], NULL, mqu_sender_run, &senders)) {
+			LOG_ERR("pthread_create error");
+			atomic_store(&senders.error, 1);
+			break;
+		}
+	}
+
+	unsigned prio = args->priority;
+	while (!atomic_load_explicit(&senders.error, memory_order_relaxed)
+	       && 1 == (ret = mqu_read_record(reader, &data, &len, &prio))) {
+		LOG_VERBOSE_HEXA(args, data, len);
+		struct mqu_record *record = malloc(sizeof(*record) + len);
+		if (!record) {
+			LOG_ERR("Cannot allocate memory");
+			ret = -1;
+			break;
+		}
+		record->seq = 0;
+		record->prio = prio;
+		record->len = len;
+		memcpy(record->data, data, len);
+		if (bucket) mqu_rate_wait(bucket);
+		mqu_ring_push(&senders.ring, record);
+	}
+
+	for (int i=0; i<started; i++) mqu_ring_push(&senders.ring, &mqu_end_record);
+	for (int i=0; i<started; i++) pthread_join(threads[i], NULL);
+	if (atomic_load(&senders.error)) ret = -1;
+
+	mqu_ring_free(&senders.ring);
+	free(threads);
+	return (0 == ret) ? 0 : 1;
+}
+
+/* Compress a message if requested, and send it through the spill if there is one,
+ * or as mqu_send_timed does */
+static int mqu_send_spilled(const struct arguments *args, mqd_t queue, struct mqu_spill *spill,
+                            struct mqu_compression *compression, const char *data, size_t len, unsigned prio)
+{
+	ssize_t n = mqu_encode(compression, &data, len);
+	if (n < 0) return -1;
+	if (spill) return mqu_spill_send(spill, data, n, prio);
+	return mqu_send_timed(args, queue, data, n, prio);
+}
+
+/* Send the records of the reader in packs of up to msgsize bytes, each
+ * sent when full, or after --linger */
+static int mqu_send_packs(const struct arguments *args, mqd_t queue, struct mqu_spill *spill,
+                          struct mqu_compression *compression, struct mqu_reader *reader,
+                          struct mqu_rate *bucket, size_t msgsize)
+{
+	uint8_t *pack = malloc(msgsize);
+	size_t used = 0; /* size of the pack, 0 if empty */
+	unsigned pack_prio = 0;
+	uint8_t *record;
+	size_t len;
+	int ret;
+
+	if (!pack) {
+		LOG_ERR("Cannot allocate memory");
+		return 1;
+	}
+
+	unsigned prio = args->priority;
+	while (1) {
+		/* an empty pack waits for input as long as needed */
+		reader->deadline = used ? reader->deadline : -1;
+		ret = mqu_read_record(reader, &record, &len, &prio);
+		if (ret < 0) break;
+
+		/* send the pack when it is due, full, at the end, or before a different priority */
+		size_t added = 0;
+		if (1 == ret && used && prio == pack_prio) added = mqu_pack_add(pack, used, msgsize, record, len);
+		if (used && !added) {
+			LOG_VERBOSE(args, "Sending a pack of %zu bytes", used);
+			if (0 != mqu_send_spilled(args, queue, spill, compression, (const char *)pack, used, pack_prio)) {
+				LOG_ERR("mq_send error: %s", strerror(errno));
+				ret = -1;
+				break;
+			}
+			used = 0;
+		}
+		if (1 != ret && 2 != ret) break;
+		if (2 == ret) continue;
+
+		LOG_VERBOSE_HEXA(args, record, len);
+		if (bucket) mqu_rate_wait(bucket);
+		if (added) {
+			used = added;
+			continue;
+		}
+		used = mqu_pack_add(pack, 0, msgsize, record, len);
+		if (!used) {
+			/* too large for a pack, sent alone */
+			if (0 != mqu_send_spilled(args, queue, spill, compression, (const char *)record, len, prio)) {
+				LOG_ERR("mq_send error: %s", strerror(errno));
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+		pack_prio = prio;
+		reader->deadline = mqu_now_ns() + args->linger;
+	}
+
+	free(pack);
+	return (0 == ret) ? 0 : 1;
+}
+
+static int cmd_send_stdin(const struct arguments *args, mqd_t queue, struct mqu_spill *spill,
+                          struct mqu_compression *compression)
+{
+	struct mq_attr attr;
+	struct mqu_reader reader;
+	struct mqu_rate bucket;
+	uint8_t *record;
+	size_t len;
+	int ret;
+
+	// retrieve the message size
+	ret = mq_getattr(queue, &attr);
+	if (0 != ret) {
+		LOG_ERR("mq_getattr error: %s", strerror(errno));
+		return 1;
+	}
+
+	if (0 != mqu_reader_init(&reader, 0, args->delimiter, args->framing, attr.mq_msgsize)) {
+		LOG_ERR("Cannot allocate memory");
+		return 1;
+	}
+
+	if (args->rate > 0) mqu_rate_init(&bucket, args->rate);
+
+	if (args->threads > 1) {
+		ret = mqu_send_threads(args, &reader, args->rate > 0 ? &bucket : NULL);
+		mqu_reader_free(&reader);
+		return ret;
+	}
+	if (args->pack) {
+		/* packs start with MQU_PACK_MAGIC, so they keep room to be marked as not compressed */
+		ret = mqu_send_packs(args, queue, spill, compression, &reader, args->rate > 0 ? &bucket : NULL,
+		                     attr.mq_msgsize - (compression->codec ? 1 : 0));
+		mqu_reader_free(&reader);
+		return ret;
+	}
+
+	unsigned prio = args->priority;
+	while (1 == (ret = mqu_read_record(&reader, &record, &len, &prio))) {
+		LOG_VERBOSE_HEXA(args, record, len);
+		if (args->rate > 0) mqu_rate_wait(&bucket);
+		int rv = mqu_send_spilled(args, queue, spill, compression, (const char *)record, len, prio);
+		if (0 != rv) {
+			LOG_ERR("mq_send error: %s", strerror(errno));
+			break;
+		}
+	}
+
+	mqu_reader_free(&reader);
+	return (0 == ret) ? 0 : 1;
+}
+
+static int cmd_send(const struct arguments *args)
+{
+	struct mqu_compression compression = { NULL, NULL, 0 };
+	struct mqu_spill *spill = NULL;
+	struct mq_attr attr;
+	int ret;
+	mqd_t queue = mqu_open_wo(args, args->qname);
+	if (-1 == queue) return 1;
+
+	if (args->compress >= 0) {
+		if (0 != mq_getattr(queue, &attr)) {
+			LOG_ERR("mq_getattr error: %s", strerror(errno));
+			mq_close(queue);
+			return 1;
+		}
+		if (0 != mqu_compression_init(args, &compression, attr.mq_msgsize)) {
+			mq_close(queue);
+			return 1;
+		}
+	}
+
+	if (args->spill_dir) {
+		LOG_VERBOSE(args, "Spilling to %s", args->spill_dir);
+		spill = mqu_spill_open(args->spill_dir, args->qname, queue, args->stats_data);
+		if (!spill) {
+			if (EWOULDBLOCK == errno) LOG_ERR("The spill of %s in %s is used by another process",
+			                                  args->qname, args->spill_dir);
+			else LOG_ERR("Cannot open the spill in %s: %s", args->spill_dir, strerror(errno));
+			mq_close(queue);
+			return 1;
+		}
+	}
+
+	if (args->from_stdin) {
+		ret = cmd_send_stdin(args, queue, spill, &compression);
+	} else {
+		LOG_VERBOSE_HEXA(args, (const uint8_t *)args->message, args->msglen);
+
+		/* Send */
+		ret = mqu_send_spilled(args, queue, spill, &compression, args->message, args->msglen, args->priority);
+		if (0 != ret) {
+			LOG_ERR("mq_send error: %s", strerror(errno));
+			ret = 1;
+		}
+	}
+
+	if (spill) {
+		size_t pending = mqu_spill_pending(spill);
+		if (pending && args->blocking) LOG_VERBOSE(args, "Waiting for %zu spilled messages", pending);
+		/* with -n, the messages stay in the spill for the next send */
+		if (0 != mqu_spill_close(spill, args->blocking)) {
+			LOG_ERR("Cannot send the spilled messages: %s", strerror(errno));
+			ret = 1;
+		}
+	}
+
+	mqu_compression_free(&compression);
+	mq_close(queue);
+	return ret;
+}
+
+static mqd_t mqu_open_ro(const struct arguments *args, const char *qname)
+{
+	mqd_t queue;
+	int oflag = O_RDONLY;
+	if (!args->blocking) oflag |= O_NONBLOCK;
+
+	LOG_VERBOSE(args, "Opening mq %s (O_RDONLY%s)",
+	            qname, (oflag & O_NONBLOCK)?", O_NONBLOCK":"");
+
+	queue = mq_open(qname, oflag);
+	if (-1 == queue) LOG_ERR("mq_open error: %s", strerror(errno));
+
+	return queue;
+}
+
+static int mqu_cmp_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void mqu_free_names(char **names, int count)
+{
+	for (int i=0; i<count; i++) free(names[i]);
+	free(names);
+}
+
+/* Expand the queue names that contain wildcards
+ *
+ * Patterns are matched against the entries of MQ_DIR, or of SHM_DIR for
+ * the shm transport, and a pattern that matches no queue is an error
+ * unless allow_none is set.
+ * Return the number of names stored in *names, or -1 on error.
+ */
+static int mqu_expand_qnames(const struct arguments *args, char **patterns, int npatterns, char ***names,
+                             int allow_none)
+{
+	int shm = (MQU_TRANSPORT_SHM == args->transport);
+	const char *dirname = shm ? SHM_DIR : MQ_DIR;
+	const char *prefix = shm ? SHM_PREFIX : "";
+	size_t prefix_len = strlen(prefix);
+	char **result = NULL;
+	int count = 0;
+	int allocated = 0;
+
+	for (int i=0; i<npatterns; i++) {
+		const char *pattern = patterns[i];
+		int first = count;
+
+		if (!strpbrk(pattern, "*?[")) {
+			if (count == allocated) {
+				allocated = allocated ? 2*allocated : 16;
+				result = realloc(result, allocated * sizeof(char *));
+			}
+			result[count++] = strdup(pattern);
+			continue;
+		}
+
+		DIR *dir = opendir(dirname);
+		if (!dir) {
+			LOG_ERR("Cannot open %s: %s", dirname, strerror(errno));
+			mqu_free_names(result, count);
+			return -1;
+		}
+		struct dirent *entry;
+		while ((entry = readdir(dir))) {
+			if ('.' == entry->d_name[0]) continue;
+			if (0 != strncmp(entry->d_name, prefix, prefix_len)) continue;
+			const char *qname = entry->d_name + prefix_len;
+			if (0 != fnmatch(pattern + ('/' == pattern[0]), qname, 0)) continue;
+			if (count == allocated) {
+				allocated = allocated ? 2*allocated : 16;
+				result = realloc(result, allocated * sizeof(char *));
+			}
+			result[count] = malloc(strlen(qname) + 2);
+			sprintf(result[count], "/%s", qname);
+			count++;
+		}
+		closedir(dir);
+
+		if (count == first && !allow_none) {
+			LOG_ERR("No queue matching '%s'", pattern);
+			mqu_free_names(result, count);
+			return -1;
+		}
+		qsort(result + first, count - first, sizeof(char *), mqu_cmp_names);
+	}
+
+	*names = result;
+	return count;
+}
+
+static int mqu_find_name(char **names, int count, const char *name)
+{
+	for (int i=0; i<count; i++) {
+		if (0 == strcmp(names[i], name)) return i;
+	}
+	return -1;
+}
+
+/* Read the fields of the status line of a queue descriptor
+ * (QSIZE:... NOTIFY:... SIGNO:... NOTIFY_PID:...) on Linux */
+static void mqu_read_status(mqd_t queue, long *qsize, long *notify_pid)
+{
+	char status[256];
+	const char *field;
+
+	ssize_t n = pread(queue, status, sizeof(status) - 1, 0);
+	status[n > 0 ? n : 0] = '\0';
+
+	*qsize = 0;
+	*notify_pid = 0;
+	if ((field = strstr(status, "QSIZE:"))) *qsize = atol(field + 6);
+	if ((field = strstr(status, "NOTIFY_PID:"))) *notify_pid = atol(field + 11);
+}
+
+/* Print a string between double quotes, escaping it for JSON,
+ * or for the label values of Prometheus if prometheus is set */
+static void mqu_print_quoted(const char *str, int prometheus)
+{
+	putchar('"');
+	for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+		if ('"' == *c || '\\' == *c) printf("\\%c", *c);
+		else if ('\n' == *c) printf("\\n");
+		else if (*c < 0x20 && !prometheus) printf("\\u%04x", *c);
+		else putchar(*c);
+	}
+	putchar('"');
+}
+
+/* Attributes of a queue, as printed by info */
+struct mqu_info {
+	const char *qname;
+	int ok; /* the queue could be opened and queried */
+	struct mq_attr attr;
+	long qsize;
+	long notify_pid;
+};
+
+/* Print the metrics of the queues in the text format of Prometheus */
+static void mqu_print_prometheus(const struct mqu_info *infos, int count)
+{
+	static const struct {
+		const char *name;
+		const char *help;
+	} metrics[] = {
+		{ "mq_messages", "Number of messages in the queue" },
+		{ "mq_max_messages", "Maximum number of messages in the queue" },
+		{ "mq_message_size_bytes", "Maximum size of a message" },
+		{ "mq_queue_bytes", "Number of bytes in the queue" },
+	};
+
+	for (size_t m=0; m<sizeof(metrics)/sizeof(metrics[0]); m++) {
+		printf("# HELP %s %s\n", metrics[m].name, metrics[m].help);
+		printf("# TYPE %s gauge\n", metrics[m].name);
+		for (int i=0; i<count; i++) {
+			const struct mqu_info *info = &infos[i];
+			long values[] = { info->attr.mq_curmsgs, info->attr.mq_maxmsg, info->attr.mq_msgsize, info->qsize };
+			if (!info->ok) continue;
+			printf("%s{queue=", metrics[m].name);
+			mqu_print_quoted(info->qname, 1);
+			printf("} %ld\n", values[m]);
+		}
+	}
+}
+
+/* Print the attributes of queues, in the format given by --format */
+static int cmd_info(const struct arguments *args)
+{
+	char *all[] = { "/*" };
+	char **qnames;
+	int ret = 0;
+
+	int qcount = args->all ? mqu_expand_qnames(args, all, 1, &qnames, 1)
+	                       : mqu_expand_qnames(args, args->qnames, args->qcount, &qnames, 0);
+	if (qcount < 0) return 1;
+
+	struct mqu_info *infos = calloc(qcount ? qcount : 1, sizeof(*infos));
+	for (int i=0; i<qcount; i++) {
+		struct mqu_info *info = &infos[i];
+		info->qname = qnames[i];
+
+		if (MQU_TRANSPORT_SHM == args->transport) {
+			struct mqu_shm *shm = mqu_open_shm(args, qnames[i], O_RDONLY);
+			if (!shm) {
+				ret = 1;
+				continue;
+			}
+			mqu_shm_getattr(shm, &info->attr);
+			mqu_shm_close(shm);
+			info->ok = 1;
+			continue;
+		}
+
+		LOG_VERBOSE(args, "Opening mq %s (O_RDONLY)", qnames[i]);
+		mqd_t queue = mq_open(qnames[i], O_RDONLY);
+		if (-1 == queue) {
+			LOG_ERR("mq_open error on %s: %s", qnames[i], strerror(errno));
+			ret = 1;
+			continue;
+		}
+		if (0 != mq_getattr(queue, &info->attr)) {
+			LOG_ERR("mq_getattr error on %s: %s", qnames[i], strerror(errno));
+			ret = 1;
+		} else {
+			mqu_read_status(queue, &info->qsize, &info->notify_pid);
+			info->ok = 1;
+		}
+		mq_close(queue);
+	}
+
+	if (MQU_FMT_JSON == args->format) printf("[");
+	if (MQU_FMT_CSV == args->format) printf("name,maxmsg,msgsize,curmsgs,qsize,notify_pid\n");
+	if (MQU_FMT_PROMETHEUS == args->format) mqu_print_prometheus(infos, qcount);
+
+	int printed = 0;
+	for (int i=0; i<qcount && MQU_FMT_PROMETHEUS != args->format; i++) {
+		const struct mqu_info *info = &infos[i];
+		if (!info->ok) continue;
+
+		switch (args->format) {
+		case MQU_FMT_JSON:
+			printf("%s{\"name\":", printed ? "," : "");
+			mqu_print_quoted(info->qname, 0);
+			printf(",\"maxmsg\":%ld,\"msgsize\":%ld,\"curmsgs\":%ld,\"qsize\":%ld,\"notify_pid\":%ld}",
+			       info->attr.mq_maxmsg, info->attr.mq_msgsize, info->attr.mq_curmsgs,
+			       info->qsize, info->notify_pid);
+			break;
+		case MQU_FMT_CSV:
+			if (strpbrk(info->qname, ",\"\n")) {
+				/* quote the field, doubling its quotes */
+				putchar('"');
+				for (const char *c = info->qname; *c; c++) {
+					if ('"' == *c) putchar('"');
+					putchar(*c);
+				}
+				putchar('"');
+			} else {
+				printf("%s", info->qname);
+			}
+			printf(",%ld,%ld,%ld,%ld,%ld\n", info->attr.mq_maxmsg, info->attr.mq_msgsize,
+			       info->attr.mq_curmsgs, info->qsize, info->notify_pid);
+			break;
+		default:
+			printf("%s: maxmsg=%ld, msgsize=%ld, curmsgs=%ld\n",
+			       info->qname, info->attr.mq_maxmsg, info->attr.mq_msgsize, info->attr.mq_curmsgs);
+			break;
+		}
+		printed++;
+	}
+	if (MQU_FMT_JSON == args->format) printf("]\n");
+
+	free(infos);
+	mqu_free_names(qnames, qcount);
+	return ret;
+}
+
+/* Match a message, which may contain '\0' and is not terminated */
+static int mqu_regex_match(const regex_t *regex, const uint8_t *data, size_t len)
+{
+	regmatch_t range = { 0, len };
+	return 0 == regexec(regex, (const char *)data, 1, &range, REG_STARTEND);
+}
+
+/* Find needle in haystack
+ *
+ * The candidates are found 16 positions at a time, where both the first
+ * and the last byte of the needle match, then compared with memcmp.
+ */
+static const uint8_t *mqu_memmem(const uint8_t *haystack, size_t len, const uint8_t *needle, size_t nlen)
+{
+	size_t i = 0;
+
+	if (0 == nlen) return haystack;
+	if (nlen > len) return NULL;
+#if defined(__SSE2__)
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+	for (; i + nlen - 1 + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(haystack + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(haystack + i + nlen - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+			if (0 == memcmp(haystack + i + bit, needle, nlen)) return haystack + i + bit;
+			mask &= mask - 1;
+		}
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	const uint8x16_t first = vdupq_n_u8(needle[0]);
+	const uint8x16_t last = vdupq_n_u8(needle[nlen - 1]);
+	for (; i + nlen - 1 + 16 <= len; i += 16) {
+		uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(haystack + i), first),
+		                         vceqq_u8(vld1q_u8(haystack + i + nlen - 1), last));
+		/* 4 bits per position */
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+		while (mask) {
+			int bit = __builtin_ctzll(mask) >> 2;
+			if (0 == memcmp(haystack + i + bit, needle, nlen)) return haystack + i + bit;
+			mask &= ~(0xfULL << (bit * 4));
+		}
+	}
+#endif
+	return memmem(haystack + i, len - i, needle, nlen);
+}
+
+/* Tell whether a message is kept by the filter */
+static int mqu_filter_match(const struct mqu_filter *filter, const uint8_t *data, size_t len)
+{
+	if (filter->prefix && (len < filter->prefix_len || 0 != memcmp(data, filter->prefix, filter->prefix_len))) {
+		return 0;
+	}
+	if (filter->text && !mqu_memmem(data, len, (const uint8_t *)filter->text, filter->text_len)) return 0;
+	if (filter->regex && !mqu_regex_match(filter->regex, data, len)) return 0;
+	return 1;
+}
+
+/* Queue a received message, with its optional prefixes and the delimiter,
+ * or its framing header */
+static int mqu_output_record(const struct arguments *args, struct mqu_writer *writer,
+                             const char *qname, const uint8_t *data, size_t len, unsigned prio)
+{
+	struct iovec iov[7];
+	char timestamp[MQU_TIMESTAMP_MAX + 1];
+	char priority[16];
+	int i = 0;
+
+	if (!mqu_filter_match(&args->filter, data, len)) return 0;
+
+	if (args->framing) {
+		uint8_t header[MQU_FRAME_HEADER_MAX];
+		iov[0].iov_base = header;
+		iov[0].iov_len = mqu_frame_header(header, args->framing, len, prio);
+		iov[1].iov_base = (void *)data;
+		iov[1].iov_len = len;
+		return mqu_writer_putv(writer, iov, 2);
+	}
+
+#ifdef HAVE_VMSPLICE
+	if (writer->ring) return mqu_writer_splice(writer, data, len, args->delimiter);
+#endif
+
+	if (args->timestamp) {
+		size_t n = mqu_timestamp(timestamp, args->timestamp, args->coarse_time);
+		timestamp[n++] = ' ';
+		iov[i].iov_base = timestamp;
+		iov[i++].iov_len = n;
+	}
+	if (args->print_name) {
+		iov[i].iov_base = (void *)qname;
+		iov[i++].iov_len = strlen(qname);
+		iov[i].iov_base = ": ";
+		iov[i++].iov_len = 2;
+	}
+	if (args->print_priority) {
+		size_t n = mqu_format_u64(priority, prio);
+		priority[n++] = ' ';
+		iov[i].iov_base = priority;
+		iov[i++].iov_len = n;
+	}
+	if (MQU_FMT_HEX == args->format) {
+		if (i > 0 && 0 != mqu_writer_putv(writer, iov, i)) return -1;
+		if (0 != mqu_writer_put_hex(writer, data, len)) return -1;
+		i = 0;
+	} else {
+		iov[i].iov_base = (void *)data;
+		iov[i++].iov_len = len;
+	}
+	iov[i].iov_base = (void *)&args->delimiter;
+	iov[i++].iov_len = 1;
+
+	return mqu_writer_putv(writer, iov, i);
+}
+
+/* Format a message received, after decompressing it and unpacking its records */
+static int mqu_output(const struct arguments *args, struct mqu_writer *writer,
+                      const char *qname, const uint8_t *data, size_t len, unsigned prio)
+{
+	const uint8_t *record;
+	size_t record_len;
+	size_t offset = 0;
+	int rv;
+
+	if (writer->compression.codec) {
+		const void *result;
+		size_t n = mqu_decompress(writer->compression.codec, data, len, writer->compression.buffer,
+		                          writer->compression.size, &result);
+		if ((size_t)-1 == n) {
+			LOG_ERR("Skipping a message of %zu bytes from %s that cannot be decompressed (codec byte 0x%02x)",
+			        len, qname, data[0]);
+			return 0;
+		}
+		len = n;
+		data = result;
+	}
+
+	/* messages that are not valid packs are printed as they are */
+	if (!args->pack || len < 1 || MQU_PACK_MAGIC != data[0]) {
+		return mqu_output_record(args, writer, qname, data, len, prio);
+	}
+	while (1 == (rv = mqu_unpack(data, len, &offset, &record, &record_len)));
+	if (rv < 0) return mqu_output_record(args, writer, qname, data, len, prio);
+
+	offset = 0;
+	while (1 == mqu_unpack(data, len, &offset, &record, &record_len)) {
+		if (0 != mqu_output_record(args, writer, qname, record, record_len, prio)) return -1;
+	}
+	return 0;
+}
+
+static int cmd_recv(const struct arguments *args)
+{
+	mqd_t queue;
+	int ret;
+	uint8_t *allocated;
+	uint8_t *buffer;
+	struct mq_attr attr;
+	struct mqu_writer writer;
+	char **qnames;
+	int qcount;
+
+	qcount = mqu_expand_qnames(args, args->qnames, args->qcount, &qnames, 0);
+	if (qcount < 0) return 1;
+	if (qcount > 1) {
+		LOG_ERR("Receiving from several queues requires --follow");
+		mqu_free_names(qnames, qcount);
+		return 1;
+	}
+
+	queue = mqu_open_ro(args, qnames[0]);
+	if (-1 == queue) {
+		mqu_free_names(qnames, qcount);
+		return 1;
+	}
+
+	// retrieve the message size
+	ret = mq_getattr(queue, &attr);
+	if (0 != ret || 0 != mqu_writer_init(&writer, 1)) {
+		mq_close(queue);
+		mqu_free_names(qnames, qcount);
+		return 1;
+	}
+
+	allocated = malloc(attr.mq_msgsize);
+	if (!allocated) {
+		LOG_ERR("Cannot allocate memory");
+		ret = 1;
+	}
+	if (0 != mqu_writer_enable_decompress(args, &writer, attr.mq_msgsize)) ret = 1;
+	if (!ret && args->zero_copy && mqu_writer_enable_splice(&writer, attr.mq_msgsize) < 0) ret = 1;
+
+	/* the timeout applies to all the messages */
+	struct timespec deadline;
+	if (args->timeout >= 0) mqu_deadline(&deadline, args->timeout);
+
+	long count = args->count ? args->count : 1;
+	long received = 0;
+	while (!ret && received < count) {
+		unsigned prio = 0;
+		ssize_t n;
+		buffer = mqu_writer_recv_buffer(&writer, allocated);
+		n = mqu_receive(queue, args->stats_data, buffer, attr.mq_msgsize, &prio,
+		                (args->timeout >= 0) ? &deadline : NULL);
+		if (n < 0) {
+			if (EINTR == errno) continue;
+			/* once a message is received, running out of time or messages ends the batch */
+			if ((ETIMEDOUT == errno || EAGAIN == errno) && received) break;
+			LOG_ERR("mq_receive error: %s", strerror(errno));
+			ret = 1;
+			break;
+		}
+		if (prio < args->min_priority) {
+			LOG_VERBOSE(args, "Discarding message of priority %u", prio);
+			continue;
+		}
+		/* got a message */
+		LOG_VERBOSE_HEXA(args, buffer, n);
+		received++;
+		if (0 != mqu_output(args, &writer, qnames[0], buffer, n, prio)) ret = 1;
+		if (0 != mqu_writer_flush(&writer)) ret = 1;
+	}
+
+	free(allocated);
+	mqu_writer_free(&writer);
+	mq_close(queue);
+	mqu_free_names(qnames, qcount);
+	return ret;
+}
+
+/* A queue watched by recv --follow */
+struct mqu_source {
+	const char *qname;
+	mqd_t queue;
+	long maxmsg;
+	int pending; /* may have more messages to receive */
+};
+
+/* A queue where relayed messages are sent */
+struct mqu_target {
+	const char *qname;
+	mqd_t queue;
+};
+
+/* Where received messages go: printed by a writer, and/or forwarded */
+struct mqu_sink {
+	struct mqu_writer *writer; /* NULL if messages are not printed */
+	struct mqu_target *targets;
+	int ntargets;
+	struct mqu_target *routes; /* one per --route, NULL without */
+	long received;
+	int done; /* --count messages were received */
+};
+
+/* Send a message to a target, keeping its priority
+ *
+ * If the target is non-blocking and full, the message is dropped.
+ * Return 0 on success, -1 on error.
+ */
+static int mqu_forward(const struct arguments *args, const struct mqu_target *target,
+                       const uint8_t *data, size_t len, unsigned prio)
+{
+	while (1) {
+		if (0 == mqu_send(target->queue, args->stats_data, data, len, prio, NULL)) return 0;
+		if (EINTR == errno) continue;
+		if (EAGAIN == errno) {
+			LOG_VERBOSE(args, "%s is full, message dropped", target->qname);
+			return 0;
+		}
+		LOG_ERR("mq_send error on %s: %s", target->qname, strerror(errno));
+		return -1;
+	}
+}
+
+static int mqu_sink_put(const struct arguments *args, struct mqu_sink *sink, const struct mqu_source *src,
+                        const uint8_t *data, size_t len, unsigned prio)
+{
+	int routed = 0;
+	for (int i=0; i<args->nroutes && !routed; i++) {
+		if (!mqu_regex_match(&args->routes[i].regex, data, len)) continue;
+		if (0 != mqu_forward(args, &sink->routes[i], data, len, prio)) return -1;
+		routed = 1;
+	}
+	if (!routed && sink->writer) {
+		/* the writer filters the records, once decompressed and unpacked */
+		if (0 != mqu_output(args, sink->writer, src->qname, data, len, prio)) return -1;
+		if (mqu_writer_expired(sink->writer)) {
+			if (0 != mqu_writer_flush(sink->writer)) return -1;
+		}
+	}
+	if (!routed && sink->ntargets && mqu_filter_match(&args->filter, data, len)) {
+		for (int i=0; i<sink->ntargets; i++) {
+			if (0 != mqu_forward(args, &sink->targets[i], data, len, prio)) return -1;
+		}
+	}
+	sink->received++;
+	if (args->count && sink->received >= args->count) sink->done = 1;
+	return 0;
+}
+
+/* Open the queues of --route */
+static int mqu_sink_open_routes(const struct arguments *args, struct mqu_sink *sink)
+{
+	if (!args->nroutes) return 0;
+	sink->routes = calloc(args->nroutes, sizeof(*sink->routes));
+	if (!sink->routes) {
+		LOG_ERR("Cannot allocate memory");
+		return -1;
+	}
+	for (int i=0; i<args->nroutes; i++) sink->routes[i].queue = -1;
+	for (int i=0; i<args->nroutes; i++) {
+		sink->routes[i].qname = args->routes[i].qname;
+		sink->routes[i].queue = mqu_open_wo(args, sink->routes[i].qname);
+		if (-1 == sink->routes[i].queue) return -1;
+	}
+	return 0;
+}
+
+static void mqu_sink_close_routes(const struct arguments *args, struct mqu_sink *sink)
+{
+	if (!sink->routes) return;
+	for (int i=0; i<args->nroutes; i++) {
+		if (-1 != sink->routes[i].queue) mq_close(sink->routes[i].queue);
+	}
+	free(sink->routes);
+}
+
+/* Receive the messages available in a non-blocking queue
+ *
+ * At most maxmsg messages are received, so that a busy queue
+ * does not starve the others.
+ * Return 0 when the queue is drained, 1 if it may have more
+ * messages, -1 on error.
+ */
+static int mqu_drain(const struct arguments *args, const struct mqu_source *src,
+                     uint8_t *buffer, size_t size, struct mqu_sink *sink)
+{
+	for (long i=0; i<src->maxmsg; i++) {
+		if (sink->done) return 0;
+		unsigned prio = 0;
+		if (sink->writer) buffer = mqu_writer_recv_buffer(sink->writer, buffer);
+		ssize_t n = mqu_receive(src->queue, args->stats_data, buffer, size, &prio, NULL);
+		if (n < 0) {
+			if (EAGAIN == errno) return 0;
+			if (EINTR == errno) continue;
+			LOG_ERR("mq_receive error: %s", strerror(errno));
+			return -1;
+		}
+		/* got a message */
+		LOG_VERBOSE_HEXA(args, buffer, n);
+		if (prio < args->min_priority) {
+			LOG_VERBOSE(args, "Discarding message of priority %u", prio);
+			continue;
+		}
+		if (0 != mqu_sink_put(args, sink, src, buffer, n, prio)) return -1;
+	}
+	return !sink->done;
+}
+
+static int mqu_set_nonblock(mqd_t queue)
+{
+	struct mq_attr attr;
+
+	if (0 != mq_getattr(queue, &attr)) {
+		LOG_ERR("mq_getattr error: %s", strerror(errno));
+		return -1;
+	}
+	if (attr.mq_flags & O_NONBLOCK) return 0;
+
+	attr.mq_flags |= O_NONBLOCK;
+	if (0 != mq_setattr(queue, &attr, NULL)) {
+		LOG_ERR("mq_setattr error: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Wait for queues to become readable
+ *
+ * With epoll the queues are registered edge-triggered, so that the cost
+ * of a wakeup depends on the number of ready queues only. The caller
+ * must therefore drain a queue completely before waiting on it again.
+ *
+ * With MQU_WAKEUP_NOTIFY, mq_notify sends MQU_NOTIFY_SIGNAL, carrying
+ * the index of the queue, when a message arrives in an empty queue.
+ * The registration is removed by the notification, so the caller must
+ * call mqu_poller_rearm each time it has drained a queue.
+ */
+#define MQU_NOTIFY_SIGNAL SIGRTMIN
+
+struct mqu_poller {
+	int count;
+	int notify;
+	mqd_t *queues;
+	char *armed; /* registered with mq_notify */
+	sigset_t signals;
+#ifdef MQU_USE_EPOLL
+	int epfd;
+	struct epoll_event *events;
+#else
+	struct pollfd *ufds;
+#endif
+};
+
+/* Block the signal of mq_notify, so that it is only received by
+ * sigwaitinfo. This must be done before any thread is started. */
+static void mqu_notify_block(void)
+{
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, MQU_NOTIFY_SIGNAL);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+static int mqu_poller_init(struct mqu_poller *poller, int count, int wakeup)
+{
+	poller->count = count;
+	poller->notify = (MQU_WAKEUP_NOTIFY == wakeup);
+	if (poller->notify) {
+		sigemptyset(&poller->signals);
+		sigaddset(&poller->signals, MQU_NOTIFY_SIGNAL);
+		poller->queues = calloc(count, sizeof(*poller->queues));
+		poller->armed = calloc(count, sizeof(*poller->armed));
+		if (!poller->queues || !poller->armed) {
+			free(poller->queues);
+			free(poller->armed);
+			return -1;
+		}
+		return 0;
+	}
+#ifdef MQU_USE_EPOLL
+	poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (-1 == poller->epfd) {
+		LOG_ERR("epoll_create1 error: %s", strerror(errno));
+		return -1;
+	}
+	poller->events = calloc(count, sizeof(*poller->events));
+	if (!poller->events) {
+		close(poller->epfd);
+		return -1;
+	}
+#else
+	poller->ufds = calloc(count, sizeof(*poller->ufds));
+	if (!poller->ufds) return -1;
+	for (int i=0; i<count; i++) poller->ufds[i].fd = -1;
+#endif
+	return 0;
+}
+
+static void mqu_poller_free(struct mqu_poller *poller)
+{
+	if (poller->notify) {
+		for (int i=0; i<poller->count; i++) {
+			if (poller->armed[i]) mq_notify(poller->queues[i], NULL);
+		}
+		free(poller->queues);
+		free(poller->armed);
+		return;
+	}
+#ifdef MQU_USE_EPOLL
+	close(poller->epfd);
+	free(poller->events);
+#else
+	free(poller->ufds);
+#endif
+}
+
+/* Watch the queue, identified by index */
+static int mqu_poller_add(struct mqu_poller *poller, int index, mqd_t queue)
+{
+	if (poller->notify) {
+		/* registered by mqu_poller_rearm, once the queue is drained */
+		poller->queues[index] = queue;
+		return 0;
+	}
+#ifdef MQU_USE_EPOLL
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.u32 = index;
+	if (0 != epoll_ctl(poller->epfd, EPOLL_CTL_ADD, queue, &ev)) {
+		LOG_ERR("epoll_ctl error: %s", strerror(errno));
+		return -1;
+	}
+#else
+	poller->ufds[index].fd = queue;
+	poller->ufds[index].events = POLLIN;
+#endif
+	return 0;
+}
+
+/* Prepare the wakeup of a drained queue
+ *
+ * Return 1 if the queue must be drained again, because a message may have
+ * arrived before the wakeup was ready, 0 if not, -1 on error.
+ */
+static int mqu_poller_rearm(struct mqu_poller *poller, int index)
+{
+	if (!poller->notify || poller->armed[index]) return 0;
+
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_SIGNAL;
+	sev.sigev_signo = MQU_NOTIFY_SIGNAL;
+	sev.sigev_value.sival_int = index;
+	if (0 != mq_notify(poller->queues[index], &sev)) {
+		LOG_ERR("mq_notify error: %s", strerror(errno));
+		return -1;
+	}
+	poller->armed[index] = 1;
+	return 1;
+}
+
+/* Store the indexes of the readable queues in ready
+ *
+ * Return the number of readable queues (0 on timeout), or -1 on error.
+ */
+static int mqu_poller_wait(struct mqu_poller *poller, int *ready, int timeout)
+{
+	int count = 0;
+	if (poller->notify) {
+		siginfo_t info;
+		int rv;
+		if (timeout < 0) {
+			rv = sigwaitinfo(&poller->signals, &info);
+		} else {
+			struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+			rv = sigtimedwait(&poller->signals, &info, &ts);
+		}
+		if (rv < 0) {
+			if (EINTR == errno || EAGAIN == errno) return 0;
+			LOG_ERR("sigwaitinfo error: %s", strerror(errno));
+			return -1;
+		}
+		int index = info.si_value.sival_int;
+		if (index < 0 || index >= poller->count) return 0;
+		poller->armed[index] = 0;
+		ready[count++] = index;
+		return count;
+	}
+#ifdef MQU_USE_EPOLL
+	int rv = epoll_wait(poller->epfd, poller->events, poller->count, timeout);
+	if (rv == -1) {
+		if (EINTR == errno) return 0;
+		LOG_ERR("epoll_wait error: %s", strerror(errno));
+		return -1;
+	}
+	for (int i=0; i<rv; i++) {
+		if (!(poller->events[i].events & EPOLLIN)) {
+			LOG_ERR("epoll events != EPOLLIN (%x)", poller->events[i].events);
+			return -1;
+		}
+		ready[count++] = poller->events[i].data.u32;
+	}
+#else
+	int rv = poll(poller->ufds, poller->count, timeout);
+	if (rv == -1) {
+		if (EINTR == errno) return 0;
+		LOG_ERR("poll error: %s", strerror(errno));
+		return -1;
+	}
+	for (int i=0; i<poller->count && count<rv; i++) {
+		if (!poller->ufds[i].revents) continue;
+		if (!(poller->ufds[i].revents & POLLIN)) {
+			LOG_ERR("poll revents != POLLIN (%x)", poller->ufds[i].revents);
+			return -1;
+		}
+		ready[count++] = i;
+	}
+#endif
+	return count;
+}
+
+/* Apply --cpu, --sched and --mlock to the calling thread, before it
+ * starts any thread: the threads inherit its affinity and policy. */
+static int mqu_setup_consumer(const struct arguments *args)
+{
+	if (args->ncpus && 0 != sched_setaffinity(0, sizeof(args->cpus), &args->cpus)) {
+		LOG_ERR("sched_setaffinity error: %s", strerror(errno));
+		return -1;
+	}
+	if (-1 != args->sched_policy) {
+		struct sched_param param = { .sched_priority = args->sched_priority };
+		if (0 != sched_setscheduler(0, args->sched_policy, &param)) {
+			LOG_ERR("sched_setscheduler error: %s%s", strerror(errno),
+			        (EPERM == errno) ? " (real-time policies need CAP_SYS_NICE or RLIMIT_RTPRIO)" : "");
+			return -1;
+		}
+	}
+	if (args->mlock && 0 != mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		LOG_ERR("mlockall error: %s%s", strerror(errno), (ENOMEM == errno) ? " (see RLIMIT_MEMLOCK)" : "");
+		return -1;
+	}
+	return 0;
+}
+
+/* Spin on the non-blocking descriptors for --busy-poll, instead of
+ * waiting on the poller, as long as nothing is received
+ *
+ * The queues found with more messages are added to ready. The wakeups
+ * of the messages received here are left to the poller, as spurious
+ * wakeups of drained queues.
+ * Return 1 if messages were received, 0 if not, -1 on error.
+ */
+static int mqu_busy_poll(const struct arguments *args, struct mqu_source *sources, int count,
+                         int *ready, int *nready, uint8_t *buffer, size_t size, struct mqu_sink *sink)
+{
+	long received = sink->received;
+	uint64_t until = mqu_now_ns() + args->busy_poll;
+
+	do {
+		for (int i=0; i<count; i++) {
+			int rv = mqu_drain(args, &sources[i], buffer, size, sink);
+			if (rv < 0) return -1;
+			if (rv > 0 && !sources[i].pending) {
+				sources[i].pending = 1;
+				ready[(*nready)++] = i;
+			}
+		}
+	} while (received == sink->received && !sink->done && mqu_now_ns() < until);
+	return received != sink->received;
+}
+
+/* Receive the messages of a single queue with blocking mq_receive
+ *
+ * Each burst waits for a message, then takes those already queued, so
+ * that the output is flushed once per burst.
+ * Return 0 after --count messages or --timeout without messages, 1 on error.
+ */
+#define MQU_BURST_MAX 64 /* messages */
+#define MQU_BURST_BYTES (1 << 20) /* size of the buffer of a burst, at least one message */
+
+static int mqu_follow_blocking(const struct arguments *args, const char *qname, struct mqu_sink *sink)
+{
+	int ret = 1;
+	uint8_t *buffer = NULL;
+	struct mqu_message messages[MQU_BURST_MAX];
+	struct mqu_source src;
+
+	LOG_VERBOSE(args, "Opening mq %s (O_RDONLY)", qname);
+	struct mqu_queue *queue = mqu_queue_open(qname, O_RDONLY, 0, NULL);
+	if (!queue) {
+		LOG_ERR("mq_open error: %s", strerror(errno));
+		return 1;
+	}
+	mqu_queue_set_stats(queue, args->stats_data);
+	size_t msgsize = mqu_queue_msgsize(queue);
+	src.qname = qname;
+	src.queue = mqu_queue_descriptor(queue);
+	src.maxmsg = mqu_queue_maxmsg(queue);
+
+	size_t burst = MQU_BURST_BYTES / msgsize;
+	if (burst > MQU_BURST_MAX) burst = MQU_BURST_MAX;
+	if (burst > (size_t)src.maxmsg) burst = src.maxmsg;
+	if (burst < 1) burst = 1;
+	buffer = malloc(burst * msgsize);
+	if (!buffer) {
+		LOG_ERR("Cannot allocate memory");
+		goto end;
+	}
+	if (sink->writer && 0 != mqu_writer_enable_decompress(args, sink->writer, msgsize)) goto end;
+	if (sink->writer && args->zero_copy && mqu_writer_enable_splice(sink->writer, msgsize) < 0) goto end;
+
+	while (!sink->done) {
+		/* a free slot of --zero-copy takes a single message */
+		uint8_t *data = sink->writer ? mqu_writer_recv_buffer(sink->writer, buffer) : buffer;
+		size_t max = (data == buffer) ? burst : 1;
+		/* and --count stops before the messages that would not be printed */
+		if (args->count && (size_t)(args->count - sink->received) < max) max = args->count - sink->received;
+
+		ssize_t n = mqu_queue_receive_burst(queue, messages, max, data, max * msgsize, args->timeout);
+		if (n < 0) {
+			if (EINTR == errno) continue;
+			if (ETIMEDOUT == errno) {
+				LOG_VERBOSE(args, "No message received for the timeout, exiting");
+				break;
+			}
+			LOG_ERR("mq_receive error: %s", strerror(errno));
+			goto end;
+		}
+		for (ssize_t i=0; i<n && !sink->done; i++) {
+			LOG_VERBOSE_HEXA(args, messages[i].data, messages[i].len);
+			if (messages[i].prio < args->min_priority) {
+				LOG_VERBOSE(args, "Discarding message of priority %u", messages[i].prio);
+			} else if (0 != mqu_sink_put(args, sink, &src, messages[i].data, messages[i].len, messages[i].prio)) {
+				goto end;
+			}
+		}
+
+		if (sink->writer && 0 != mqu_writer_flush(sink->writer)) goto end;
+	}
+	ret = 0;
+
+end:
+	free(buffer);
+	mqu_queue_close(queue);
+	return ret;
+}
+
+/* Receive messages from the queues as they arrive, and pass them to the sink
+ *
+ * Return 0 after --count messages or --timeout without messages, 1 on error.
+ */
+static int mqu_follow(const struct arguments *args, char **qnames, int qcount, struct mqu_sink *sink)
+{
+	int ret = 1;
+	uint8_t *buffer = NULL;
+	long msgsize = 0;
+	struct mq_attr attr;
+	struct mqu_poller poller;
+	struct mqu_source *sources;
+	int opened = 0;
+	int *woken = NULL;
+	int *ready = NULL; /* queues that may have more messages */
+	int nready = 0;
+
+	if (MQU_WAKEUP_BLOCKING == args->wakeup) {
+		if (1 != qcount) {
+			LOG_ERR("--wakeup=blocking can only receive from a single queue");
+			return 1;
+		}
+		return mqu_follow_blocking(args, qnames[0], sink);
+	}
+
+	if (0 != mqu_poller_init(&poller, qcount, args->wakeup)) return 1;
+
+	sources = calloc(qcount, sizeof(*sources));
+	woken = calloc(qcount, sizeof(*woken));
+	ready = calloc(qcount, sizeof(*ready));
+	if (!sources || !woken || !ready) {
+		LOG_ERR("Cannot allocate memory");
+		goto end;
+	}
+
+	for (opened = 0; opened < qcount; opened++) {
+		struct mqu_source *src = &sources[opened];
+		src->qname = qnames[opened];
+		src->queue = mqu_open_ro(args, src->qname);
+		if (-1 == src->queue) goto end;
+
+		// retrieve the message size
+		if (0 != mq_getattr(src->queue, &attr)) {
+			LOG_ERR("mq_getattr error: %s", strerror(errno));
+			mq_close(src->queue);
+			goto end;
+		}
+		src->maxmsg = attr.mq_maxmsg;
+		if (attr.mq_msgsize > msgsize) msgsize = attr.mq_msgsize;
+
+		/* the poller does the waiting, so that each wakeup drains the queue */
+		if (0 != mqu_set_nonblock(src->queue) || 0 != mqu_poller_add(&poller, opened, src->queue)) {
+			mq_close(src->queue);
+			goto end;
+		}
+
+		/* messages may already be queued */
+		src->pending = 1;
+		ready[nready++] = opened;
+	}
+
+	/* one buffer, large enough for all the queues */
+	buffer = malloc(msgsize);
+	if (!buffer) {
+		LOG_ERR("Cannot allocate memory");
+		goto end;
+	}
+	if (sink->writer && 0 != mqu_writer_enable_decompress(args, sink->writer, msgsize)) goto end;
+	if (sink->writer && args->zero_copy && mqu_writer_enable_splice(sink->writer, msgsize) < 0) goto end;
+
+	uint64_t idle_since = mqu_now_ns();
+	long seen = 0;
+	while (1) {
+		int spun = 0;
+		if (!nready && args->busy_poll) {
+			spun = mqu_busy_poll(args, sources, qcount, ready, &nready, buffer, msgsize, sink);
+			if (spun < 0) break;
+		}
+		/* do not block while some queues are not drained */
+		int timeout = (nready || spun) ? 0 : -1;
+		if (timeout && args->timeout >= 0) {
+			int64_t left = (int64_t)(idle_since + args->timeout - mqu_now_ns());
+			if (left <= 0) {
+				LOG_VERBOSE(args, "No message received for the timeout, exiting");
+				ret = 0;
+				break;
+			}
+			timeout = (int)((left + 999999) / 1000000);
+		}
+		uint64_t start = mqu_stats_start(args->stats_data);
+		int rv = mqu_poller_wait(&poller, woken, timeout);
+		mqu_stats_wait(args->stats_data, start);
+		if (rv < 0) break;
+
+		for (int i=0; i<rv; i++) {
+			struct mqu_source *src = &sources[woken[i]];
+			if (src->pending) continue;
+			src->pending = 1;
+			ready[nready++] = woken[i];
+		}
+
+		int kept = 0;
+		int i;
+		for (i=0; i<nready; i++) {
+			struct mqu_source *src = &sources[ready[i]];
+			rv = mqu_drain(args, src, buffer, msgsize, sink);
+			if (0 == rv) rv = mqu_poller_rearm(&poller, ready[i]);
+			if (rv < 0) break;
+			if (rv > 0) ready[kept++] = ready[i];
+			else src->pending = 0;
+		}
+		if (i < nready) break;
+		nready = kept;
+
+		/* flush once per burst */
+		if (sink->writer && 0 != mqu_writer_flush(sink->writer)) break;
+
+		if (sink->done) {
+			ret = 0;
+			break;
+		}
+		if (args->timeout >= 0 && sink->received != seen) {
+			seen = sink->received;
+			idle_since = mqu_now_ns();
+		}
+	}
+
+end:
+	for (int i=0; i<opened; i++) mq_close(sources[i].queue);
+	mqu_poller_free(&poller);
+	free(buffer);
+	free(ready);
+	free(woken);
+	free(sources);
+	return ret;
+}
+
+static int cmd_recv_follow(const struct arguments *args)
+{
+	struct mqu_writer writer;
+	struct mqu_sink sink = { &writer, NULL, 0 };
+	char **qnames;
+	int qcount;
+
+	qcount = mqu_expand_qnames(args, args->qnames, args->qcount, &qnames, 0);
+	if (qcount < 0) return 1;
+
+	if (0 != mqu_writer_init(&writer, 1)) {
+		LOG_ERR("Cannot allocate memory");
+		mqu_free_names(qnames, qcount);
+		return 1;
+	}
+
+	int ret = 1;
+	if (0 == mqu_sink_open_routes(args, &sink) && 0 == mqu_setup_consumer(args)) {
+		ret = mqu_follow(args, qnames, qcount, &sink);
+	}
+
+	if (0 != mqu_writer_flush(&writer)) ret = 1;
+	mqu_sink_close_routes(args, &sink);
+	mqu_writer_free(&writer);
+	mqu_free_names(qnames, qcount);
+	return ret;
+}
+
+/* State shared by the workers of recv --follow --workers */
+struct mqu_pool {
+	const struct arguments *args;
+	const char *qname;
+	mqd_t queue;
+	long msgsize;
+	struct mqu_ring ring;
+	pthread_mutex_t mutex; /* serializes receive and numbering, with --ordered */
+	uint64_t next_seq;
+};
+
+/* Receive messages, format them and pass them to the output thread */
+static void *mqu_worker_run(void *arg)
+{
+	struct mqu_pool *pool = arg;
+	const struct arguments *args = pool->args;
+	struct mqu_writer formatter;
+	uint8_t *buffer = malloc(pool->msgsize);
+	/* published in place of a numbered message that fails, so that
+	 * the output thread does not wait for it with --ordered */
+	struct mqu_record *skip = malloc(sizeof(*skip));
+	int numbered = 0;
+	uint64_t seq = 0;
+
+	if (!buffer || !skip || 0 != mqu_writer_init(&formatter, -1)) {
+		LOG_ERR("Cannot allocate memory");
+		free(buffer);
+		free(skip);
+		mqu_ring_push(&pool->ring, &mqu_end_record);
+		return NULL;
+	}
+	if (0 != mqu_writer_enable_decompress(args, &formatter, pool->msgsize)) {
+		mqu_writer_free(&formatter);
+		free(buffer);
+		free(skip);
+		mqu_ring_push(&pool->ring, &mqu_end_record);
+		return NULL;
+	}
+
+	while (1) {
+		unsigned prio = 0;
+
+		if (args->ordered) pthread_mutex_lock(&pool->mutex);
+		ssize_t n = mqu_receive(pool->queue, args->stats_data, buffer, pool->msgsize, &prio, NULL);
+		numbered = (n >= 0 && prio >= args->min_priority);
+		if (numbered) seq = pool->next_seq++;
+		if (args->ordered) pthread_mutex_unlock(&pool->mutex);
+
+		if (n < 0) {
+			if (EINTR == errno) continue;
+			LOG_ERR("mq_receive error: %s", strerror(errno));
+			break;
+		}
+		/* got a message */
+		LOG_VERBOSE_HEXA(args, buffer, n);
+		if (prio < args->min_priority) {
+			LOG_VERBOSE(args, "Discarding message of priority %u", prio);
+			continue;
+		}
+
+		formatter.len = 0;
+		if (0 != mqu_output(args, &formatter, pool->qname, buffer, n, prio)) break;
+
+		struct mqu_record *record = malloc(sizeof(*record) + formatter.len);
+		if (!record) {
+			LOG_ERR("Cannot allocate memory");
+			break;
+		}
+		record->seq = seq;
+		record->len = formatter.len;
+		memcpy(record->data, formatter.buffer, formatter.len);
+		mqu_ring_push(&pool->ring, record);
+		numbered = 0;
+	}
+
+	if (numbered) {
+		skip->seq = seq;
+		skip->len = 0;
+		mqu_ring_push(&pool->ring, skip);
+	} else {
+		free(skip);
+	}
+	mqu_writer_free(&formatter);
+	free(buffer);
+	mqu_ring_push(&pool->ring, &mqu_end_record);
+	return NULL;
+}
+
+/* Min-heap of records by sequence number, to restore the arrival order */
+struct mqu_heap {
+	struct mqu_record **records;
+	size_t count;
+	size_t size;
+};
+
+static int mqu_heap_push(struct mqu_heap *heap, struct mqu_record *record)
+{
+	if (heap->count == heap->size) {
+		size_t size = heap->size ? 2*heap->size : 64;
+		struct mqu_record **records = realloc(heap->records, size * sizeof(*records));
+		if (!records) {
+			LOG_ERR("Cannot allocate memory");
+			return -1;
+		}
+		heap->records = records;
+		heap->size = size;
+	}
+
+	size_t i = heap->count++;
+	while (i > 0 && heap->records[(i-1)/2]->seq > record->seq) {
+		heap->records[i] = heap->records[(i-1)/2];
+		i = (i-1)/2;
+	}
+	heap->records[i] = record;
+	return 0;
+}
+
+static struct mqu_record *mqu_heap_pop(struct mqu_heap *heap)
+{
+	struct mqu_record *top = heap->records[0];
+	struct mqu_record *last = heap->records[--heap->count];
+	size_t i = 0;
+
+	while (2*i + 1 < heap->count) {
+		size_t child = 2*i + 1;
+		if (child + 1 < heap->count && heap->records[child+1]->seq < heap->records[child]->seq) child++;
+		if (last->seq <= heap->records[child]->seq) break;
+		heap->records[i] = heap->records[child];
+		i = child;
+	}
+	if (heap->count) heap->records[i] = last;
+	return top;
+}
+
+static int mqu_write_record(struct mqu_writer *writer, struct mqu_record *record)
+{
+	struct iovec iov;
+	iov.iov_base = record->data;
+	iov.iov_len = record->len;
+	int rv = mqu_writer_putv(writer, &iov, 1);
+	free(record);
+	return rv;
+}
+
+/* Receive in several threads and write from this one
+ *
+ * Return only on error.
+ */
+static int cmd_recv_workers(const struct arguments *args_in)
+{
+	struct arguments args = *args_in;
+	struct mqu_pool pool;
+	struct mqu_writer writer;
+	struct mqu_heap heap = { NULL, 0, 0 };
+	struct mq_attr attr;
+	char **qnames;
+	int qcount;
+	int started = 0;
+
+	qcount = mqu_expand_qnames(&args, args.qnames, args.qcount, &qnames, 0);
+	if (qcount < 0) return 1;
+	if (qcount > 1) {
+		LOG_ERR("--workers needs a single queue");
+		mqu_free_names(qnames, qcount);
+		return 1;
+	}
+
+	/* the workers block in mq_receive */
+	args.blocking = 1;
+	pool.args = &args;
+	pool.qname = qnames[0];
+	pool.next_seq = 0;
+	pool.queue = mqu_open_ro(&args, pool.qname);
+	if (-1 == pool.queue) {
+		mqu_free_names(qnames, qcount);
+		return 1;
+	}
+	if (0 != mq_getattr(pool.queue, &attr) || 0 != mqu_writer_init(&writer, 1)) {
+		mq_close(pool.queue);
+		mqu_free_names(qnames, qcount);
+		return 1;
+	}
+	pool.msgsize = attr.mq_msgsize;
+	if (0 != mqu_ring_init(&pool.ring)) {
+		LOG_ERR("Cannot allocate memory");
+		goto end;
+	}
+	pthread_mutex_init(&pool.mutex, NULL);
+	if (0 != mqu_setup_consumer(&args)) goto end;
+
+	int cpu = -1;
+	for (started=0; started<args.workers; started++) {
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		/* the CPUs of the list in turn, from the start of the worker;
+		 * the output thread keeps them all */
+		if (args.ncpus) {
+			cpu_set_t one;
+			do cpu = (cpu + 1) % CPU_SETSIZE; while (!CPU_ISSET(cpu, &args.cpus));
+			CPU_ZERO(&one);
+			CPU_SET(cpu, &one);
+			pthread_attr_setaffinity_np(&attr, sizeof(one), &one);
+		}
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		int rv = pthread_create(&thread, &attr, mqu_worker_run, &pool);
+		pthread_attr_destroy(&attr);
+		if (0 != rv) {
+			LOG_ERR("pthread_create error");
+			break;
+		}
+	}
+
+	uint64_t next = 0;
+	while (started) {
+		struct mqu_record *record;
+
+		/* flush when the workers have nothing more for now */
+		if (!mqu_ring_trypop(&pool.ring, &record)) {
+			if (0 != mqu_writer_flush(&writer)) break;
+			record = mqu_ring_pop(&pool.ring);
+		}
+		/* the workers still running stay blocked in mq_receive */
+		if (&mqu_end_record == record) break;
+
+		if (!args.ordered) {
+			if (0 != mqu_write_record(&writer, record)) break;
+		} else {
+			if (0 != mqu_heap_push(&heap, record)) break;
+			while (heap.count && heap.records[0]->seq == next) {
+				if (0 != mqu_write_record(&writer, mqu_heap_pop(&heap))) break;
+				next++;
+			}
+		}
+		if (mqu_writer_expired(&writer) && 0 != mqu_writer_flush(&writer)) break;
+	}
+
+end:
+	/* the process exits with the workers still running */
+	mqu_writer_flush(&writer);
+	mqu_writer_free(&writer);
+	mqu_free_names(qnames, qcount);
+	return 1;
+}
+
+/* Forward the messages of the source queue to the destination queues */
+static int cmd_relay(const struct arguments *args)
+{
+	struct mqu_sink sink = { NULL, NULL, 0 };
+	char **qnames;
+	int qcount;
+	int ret = 1;
+
+	qcount = mqu_expand_qnames(args, args->qnames, 1, &qnames, 0);
+	if (qcount < 0) return 1;
+
+	sink.targets = calloc(args->qcount - 1, sizeof(*sink.targets));
+	if (!sink.targets) {
+		LOG_ERR("Cannot allocate memory");
+		goto end;
+	}
+
+	for (sink.ntargets = 0; sink.ntargets < args->qcount - 1; sink.ntargets++) {
+		struct mqu_target *target = &sink.targets[sink.ntargets];
+		target->qname = args->qnames[sink.ntargets + 1];
+		target->queue = mqu_open_wo(args, target->qname);
+		if (-1 == target->queue) goto end;
+	}
+
+	if (0 == mqu_sink_open_routes(args, &sink) && 0 == mqu_setup_consumer(args)) {
+		ret = mqu_follow(args, qnames, qcount, &sink);
+	}
+
+end:
+	mqu_sink_close_routes(args, &sink);
+	for (int i=0; i<sink.ntargets; i++) mq_close(sink.targets[i].queue);
+	free(sink.targets);
+	mqu_free_names(qnames, qcount);
+	return ret;
+}
+
+/* Recordings: record QNAME FILE, replay FILE QNAME */
+
+#define MQU_RECORD_BUFFER (1 << 20) /* size of the writes to the recording */
+#define MQU_RECORD_SLICE_NS 100000000 /* how often record checks for a signal */
+#define MQU_REPLAY_BATCH 64
+
+static volatile sig_atomic_t mqu_interrupted;
+
+static void mqu_on_interrupt(int sig)
+{
+	(void)sig;
+	mqu_interrupted = 1;
+}
+
+static int cmd_record(const struct arguments *args)
+{
+	struct sigaction action;
+	struct mq_attr attr;
+	struct mqu_writer writer;
+	uint8_t header[MQU_RECORD_HEADER_MAX];
+	uint8_t *buffer;
+	mqd_t queue;
+	int fd;
+	int ret = 0;
+
+	queue = mqu_open_ro(args, args->qname);
+	if (-1 == queue) return 1;
+	if (0 != mq_getattr(queue, &attr)) {
+		LOG_ERR("mq_getattr error: %s", strerror(errno));
+		mq_close(queue);
+		return 1;
+	}
+
+	if (0 == strcmp("-", args->file)) fd = 1;
+	else fd = open(args->file, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		LOG_ERR("Cannot open %s: %s", args->file, strerror(errno));
+		mq_close(queue);
 		return 1;
 	}
 
-	ret = mq_getattr(queue, &attr);
-	if (0 != ret) {
-		LOG_ERR("mq_getattr error: %s", strerror(errno));
-		ret = 1;
-	} else {
-		printf("%s: maxmsg=%ld, msgsize=%ld, curmsgs=%ld\n",
-		       args->qname, attr.mq_maxmsg, attr.mq_msgsize, attr.mq_curmsgs);
+	buffer = malloc(attr.mq_msgsize);
+	if (!buffer || 0 != mqu_writer_init(&writer, fd)) {
+		LOG_ERR("Cannot allocate memory");
+		free(buffer);
+		if (1 != fd) close(fd);
+		mq_close(queue);
+		return 1;
+	}
+	/* few large writes */
+	if (0 != mqu_writer_grow(&writer, MQU_RECORD_BUFFER)) ret = 1;
+
+	struct iovec magic = { (void *)MQU_RECORDING_MAGIC, MQU_RECORDING_MAGIC_SIZE };
+	if (!ret && 0 != mqu_writer_putv(&writer, &magic, 1)) ret = 1;
+
+	/* stop on SIGINT and SIGTERM, keeping what has been recorded */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = mqu_on_interrupt;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	long received = 0;
+	uint64_t previous = 0;
+	uint64_t idle_since = mqu_now_ns();
+	while (!ret && !mqu_interrupted && (!args->count || received < args->count)) {
+		/* wait in slices, to see the signals even if another thread takes them */
+		struct timespec deadline;
+		unsigned prio = 0;
+		mqu_deadline(&deadline, MQU_RECORD_SLICE_NS);
+		ssize_t n = mqu_receive(queue, args->stats_data, buffer, attr.mq_msgsize, &prio, &deadline);
+		uint64_t now = mqu_now_ns();
+		if (n < 0) {
+			if (EINTR == errno) continue;
+			if (ETIMEDOUT != errno) {
+				LOG_ERR("mq_receive error: %s", strerror(errno));
+				ret = 1;
+				break;
+			}
+			/* keep the file current while the queue is quiet */
+			if (0 != mqu_writer_flush(&writer)) ret = 1;
+			if (args->timeout >= 0 && now - idle_since >= (uint64_t)args->timeout) break;
+			continue;
+		}
+		idle_since = now;
+		if (prio < args->min_priority) continue;
+
+		struct iovec iov[2];
+		iov[0].iov_base = header;
+		iov[0].iov_len = mqu_record_header(header, received ? now - previous : 0, n, prio);
+		iov[1].iov_base = buffer;
+		iov[1].iov_len = n;
+		if (0 != mqu_writer_putv(&writer, iov, 2)) ret = 1;
+		previous = now;
+		received++;
 	}
+	if (0 != mqu_writer_flush(&writer)) ret = 1;
+	LOG_VERBOSE(args, "Recorded %ld messages", received);
 
+	mqu_writer_free(&writer);
+	free(buffer);
+	if (1 != fd && 0 != close(fd)) {
+		LOG_ERR("write error: %s", strerror(errno));
+		ret = 1;
+	}
 	mq_close(queue);
 	return ret;
 }
 
-static int cmd_unlink(const struct arguments *args)
+/* Send the batch of messages, return 0 on success */
+static int mqu_replay_flush(struct mqu_queue *queue, struct mqu_message *batch, size_t *count)
 {
-	LOG_VERBOSE(args, "Deleting mq %s", args->qname);
-	int ret = mq_unlink(args->qname);
-
-	if (0 != ret) {
-		LOG_ERR("mq_unlink error: %s", strerror(errno));
-		return 1;
+	if (0 == *count) return 0;
+	ssize_t sent = mqu_queue_send_batch(queue, batch, *count, -1);
+	if (sent < (ssize_t)*count) {
+		LOG_ERR("mq_send error: %s", strerror(errno));
+		return -1;
 	}
+	*count = 0;
 	return 0;
 }
 
-static int cmd_send(const struct arguments *args)
+static int cmd_replay(const struct arguments *args)
 {
-	int oflag = O_WRONLY;
-	if (!args->blocking) oflag |= O_NONBLOCK;
+	struct mqu_message batch[MQU_REPLAY_BATCH];
+	struct mqu_queue *queue;
+	struct stat st;
+	uint8_t *map;
+	size_t count = 0;
+	int ret = 0;
 
-	LOG_VERBOSE(args, "Opening mq %s (O_WRONLY%s)", args->qname, (oflag & O_NONBLOCK)?", O_NONBLOCK":"");
-	mqd_t queue = mq_open(args->qname, oflag);
-	if (-1 == queue) {
+	int fd = open(args->file, O_RDONLY);
+	if (fd < 0 || 0 != fstat(fd, &st)) {
+		LOG_ERR("Cannot open %s: %s", args->file, strerror(errno));
+		if (fd >= 0) close(fd);
+		return 1;
+	}
+	size_t size = st.st_size;
+	map = (size > 0) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (MAP_FAILED == map || size < MQU_RECORDING_MAGIC_SIZE
+	    || 0 != memcmp(map, MQU_RECORDING_MAGIC, MQU_RECORDING_MAGIC_SIZE)) {
+		LOG_ERR("%s is not a recording", args->file);
+		if (MAP_FAILED != map) munmap(map, size);
+		return 1;
+	}
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	LOG_VERBOSE(args, "Opening mq %s (O_WRONLY%s)", args->qname, args->blocking ? "" : ", O_NONBLOCK");
+	queue = mqu_queue_open(args->qname, O_WRONLY | (args->blocking ? 0 : O_NONBLOCK), 0, NULL);
+	if (!queue) {
 		LOG_ERR("mq_open error: %s", strerror(errno));
+		munmap(map, size);
 		return 1;
 	}
+	mqu_queue_set_stats(queue, args->stats_data);
 
-	LOG_VERBOSE_HEXA(args, (const uint8_t *)args->message, args->msglen);
+	/* the messages are sent at start + time/speed, in batches of the ones that are due */
+	uint64_t start_ns = mqu_now_ns();
+	uint64_t time = 0;
+	long replayed = 0;
+	size_t off = MQU_RECORDING_MAGIC_SIZE;
+	while (off < size && (!args->count || replayed < args->count)) {
+		uint64_t delay;
+		size_t len;
+		unsigned prio;
+		int n = mqu_parse_record(map + off, size - off, &delay, &len, &prio);
+		if (n <= 0 || len > size - off - n) {
+			LOG_ERR("%s: invalid record at offset %zu", args->file, off);
+			ret = 1;
+			break;
+		}
+		time += delay;
 
-	/* Send */
-	int ret = mq_send(queue, args->message, args->msglen, args->priority);
-	if (0 != ret) {
-		LOG_ERR("mq_send error: %s", strerror(errno));
-		ret = 1;
+		if (args->speed > 0) {
+			uint64_t due = start_ns + (uint64_t)(time / args->speed);
+			if (due > mqu_now_ns()) {
+				if (0 != mqu_replay_flush(queue, batch, &count)) {
+					ret = 1;
+					break;
+				}
+				struct timespec ts = { due / 1000000000, due % 1000000000 };
+				while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+			}
+		}
+
+		batch[count].data = map + off + n;
+		batch[count].len = len;
+		batch[count].prio = prio;
+		count++;
+		if (MQU_REPLAY_BATCH == count && 0 != mqu_replay_flush(queue, batch, &count)) {
+			ret = 1;
+			break;
+		}
+		off += n + len;
+		replayed++;
 	}
+	if (!ret && 0 != mqu_replay_flush(queue, batch, &count)) ret = 1;
+	LOG_VERBOSE(args, "Replayed %ld messages", replayed);
 
-	mq_close(queue);
+	mqu_queue_close(queue);
+	munmap(map, size);
 	return ret;
 }
 
-static mqd_t mqu_open_ro(const struct arguments *args)
+/* Send a message, or the records read from stdin, to a shm queue */
+static int cmd_send_shm(const struct arguments *args)
 {
-	mqd_t queue;
-	int oflag = O_RDONLY;
-	if (!args->blocking) oflag |= O_NONBLOCK;
+	struct mq_attr attr;
+	struct mqu_reader reader;
+	struct mqu_rate bucket;
+	uint8_t *record;
+	size_t len;
+	int ret = 0;
 
-	LOG_VERBOSE(args, "Opening mq %s (O_RDONLY%s)",
-	            args->qname, (oflag & O_NONBLOCK)?", O_NONBLOCK":"");
+	struct mqu_shm *shm = mqu_open_shm(args, args->qname, O_WRONLY | (args->blocking ? 0 : O_NONBLOCK));
+	if (!shm) return 1;
 
-	queue = mq_open(args->qname, oflag);
-	if (-1 == queue) LOG_ERR("mq_open error: %s", strerror(errno));
+	if (!args->from_stdin) {
+		LOG_VERBOSE_HEXA(args, (const uint8_t *)args->message, args->msglen);
+		if (0 != mqu_shm_send(shm, args->stats_data, args->message, args->msglen, args->priority, args->timeout)) {
+			LOG_ERR("send error: %s", strerror(errno));
+			ret = 1;
+		}
+		mqu_shm_close(shm);
+		return ret;
+	}
 
-	return queue;
+	mqu_shm_getattr(shm, &attr);
+	if (0 != mqu_reader_init(&reader, 0, args->delimiter, args->framing, attr.mq_msgsize)) {
+		LOG_ERR("Cannot allocate memory");
+		mqu_shm_close(shm);
+		return 1;
+	}
+	if (args->rate > 0) mqu_rate_init(&bucket, args->rate);
+
+	unsigned prio = args->priority;
+	while (1 == (ret = mqu_read_record(&reader, &record, &len, &prio))) {
+		LOG_VERBOSE_HEXA(args, record, len);
+		if (args->rate > 0) mqu_rate_wait(&bucket);
+		if (0 != mqu_shm_send(shm, args->stats_data, record, len, prio, args->timeout)) {
+			LOG_ERR("send error: %s", strerror(errno));
+			break;
+		}
+	}
+
+	mqu_reader_free(&reader);
+	mqu_shm_close(shm);
+	return (0 == ret) ? 0 : 1;
 }
 
-static int cmd_recv(const struct arguments *args)
+/* Receive from a shm queue, as cmd_recv does, or as cmd_recv_follow does with -f
+ *
+ * The output is flushed when the queue is empty, before sleeping.
+ */
+static int cmd_recv_shm(const struct arguments *args)
 {
-	mqd_t queue;
-	int ret;
-	uint8_t *buffer;
 	struct mq_attr attr;
+	struct mqu_writer writer;
+	char **qnames;
+	int ret = 0;
 
-	queue = mqu_open_ro(args);
-	if (-1 == queue) return 1;
-
-	// retrieve the message size
-	ret = mq_getattr(queue, &attr);
-	if (0 != ret) {
-		mq_close(queue);
+	int qcount = mqu_expand_qnames(args, args->qnames, args->qcount, &qnames, 0);
+	if (qcount < 0) return 1;
+	if (qcount > 1) {
+		LOG_ERR("--transport=shm receives from a single queue");
+		mqu_free_names(qnames, qcount);
 		return 1;
 	}
 
-	buffer = malloc(attr.mq_msgsize);
+	struct mqu_shm *shm = mqu_open_shm(args, qnames[0], O_RDWR);
+	if (!shm) {
+		mqu_free_names(qnames, qcount);
+		return 1;
+	}
+	mqu_shm_getattr(shm, &attr);
+	uint8_t *buffer = malloc(attr.mq_msgsize);
+	if (!buffer || 0 != mqu_writer_init(&writer, 1)) {
+		LOG_ERR("Cannot allocate memory");
+		free(buffer);
+		mqu_shm_close(shm);
+		mqu_free_names(qnames, qcount);
+		return 1;
+	}
+	if (0 != mqu_setup_consumer(args)) ret = 1;
 
-	ssize_t n = mq_receive(queue, (void*)buffer, attr.mq_msgsize, NULL);
-	if (n >= 0) {
-		/* got a message */
+	/* without -f, the timeout applies to all the messages,
+	 * with -f it is the longest time without messages */
+	uint64_t end = mqu_now_ns() + (args->timeout > 0 ? args->timeout : 0);
+	long count = args->count ? args->count : !args->follow;
+	long received = 0;
+	while (!ret && (!count || received < count)) {
+		unsigned prio;
+		ssize_t n = mqu_shm_receive(shm, args->stats_data, buffer, attr.mq_msgsize, &prio, 0);
+		if (n < 0 && EAGAIN == errno && (args->blocking || args->follow)) {
+			int64_t timeout = args->timeout;
+			if (!args->follow && timeout > 0) {
+				uint64_t now = mqu_now_ns();
+				timeout = (now < end) ? (int64_t)(end - now) : 0;
+			}
+			if (0 != mqu_writer_flush(&writer)) {
+				ret = 1;
+				break;
+			}
+			n = mqu_shm_receive(shm, args->stats_data, buffer, attr.mq_msgsize, &prio, timeout);
+		}
+		if (n < 0) {
+			if (EINTR == errno) continue;
+			if (ETIMEDOUT == errno && args->follow) {
+				LOG_VERBOSE(args, "No message received for the timeout, exiting");
+				break;
+			}
+			/* once a message is received, running out of time or messages ends the batch */
+			if ((ETIMEDOUT == errno || EAGAIN == errno) && received) break;
+			LOG_ERR("receive error: %s", strerror(errno));
+			ret = 1;
+			break;
+		}
+		if (prio < args->min_priority) {
+			LOG_VERBOSE(args, "Discarding message of priority %u", prio);
+			continue;
+		}
 		LOG_VERBOSE_HEXA(args, buffer, n);
-		write(1, buffer, n);
-		write(1, &args->delimiter, 1);
-		ret = 0;
-	} else {
-		LOG_ERR("mq_receive error: %s", strerror(errno));
-		ret = 1;
+		received++;
+		if (0 != mqu_output(args, &writer, qnames[0], buffer, n, prio)) {
+			ret = 1;
+			break;
+		}
+		if (mqu_writer_expired(&writer) && 0 != mqu_writer_flush(&writer)) {
+			ret = 1;
+			break;
+		}
 	}
 
-	mq_close(queue);
+	if (0 != mqu_writer_flush(&writer)) ret = 1;
+	mqu_writer_free(&writer);
+	free(buffer);
+	mqu_shm_close(shm);
+	mqu_free_names(qnames, qcount);
 	return ret;
 }
 
-static int cmd_recv_follow(const struct arguments *args)
-{
+/* A queue monitored by top */
+struct mqu_watched {
+	char *qname;
 	mqd_t queue;
-	int ret;
-	uint8_t *buffer;
 	struct mq_attr attr;
-	struct pollfd ufds[1];
+	long qsize;      /* bytes in the queue, from the QSIZE field */
+	long notify_pid; /* process registered with mq_notify, 0 if none */
+	long prev_curmsgs;
+	long prev_qsize;
+	uint64_t prev_time; /* time of the previous sample, 0 if none */
+	double rate;       /* change of curmsgs per second */
+	double byte_rate;
+	int seen; /* still listed in MQ_DIR */
+};
 
-	queue = mqu_open_ro(args);
-	if (-1 == queue) return 1;
+static int mqu_watch_sample(const struct arguments *args, struct mqu_watched *w)
+{
+	uint64_t now = mqu_now_ns();
 
-	// retrieve the message size
-	ret = mq_getattr(queue, &attr);
-	if (0 != ret) {
-		mq_close(queue);
-		return 1;
+	if (0 != mq_getattr(w->queue, &w->attr)) {
+		LOG_VERBOSE(args, "mq_getattr error on %s: %s", w->qname, strerror(errno));
+		return -1;
 	}
 
-	buffer = malloc(attr.mq_msgsize);
+	mqu_read_status(w->queue, &w->qsize, &w->notify_pid);
 
-	ufds[0].fd = queue;
-	ufds[0].events = POLLIN;
+	if (w->prev_time) {
+		double seconds = (now - w->prev_time) / 1e9;
+		w->rate = (w->attr.mq_curmsgs - w->prev_curmsgs) / seconds;
+		w->byte_rate = (w->qsize - w->prev_qsize) / seconds;
+	}
+	w->prev_curmsgs = w->attr.mq_curmsgs;
+	w->prev_qsize = w->qsize;
+	w->prev_time = now;
+	return 0;
+}
 
-	ret = 1;
-	while (1) {
-		int rv = poll(ufds, 1, -1); // no timeout
-		if (rv == -1) {
-			LOG_ERR("poll error: %s", strerror(errno));
-		} else if (1 == rv) {
-			if (ufds[0].revents & POLLIN) {
-				// receive the message
-				ssize_t n = mq_receive(queue, (void*)buffer, attr.mq_msgsize, NULL);
-				if (n >= 0) {
-					/* got a message */
-					LOG_VERBOSE_HEXA(args, buffer, n);
-					write(1, buffer, n);
-					write(1, &args->delimiter, 1); /* delimiter */
-				} else {
-					LOG_ERR("mq_receive error: %s", strerror(errno));
-					break;
-				}
+static int mqu_cmp_watched(const void *a, const void *b)
+{
+	return strcmp(((const struct mqu_watched *)a)->qname, ((const struct mqu_watched *)b)->qname);
+}
 
+/* Monitor the depth of queues, keeping them open between samples */
+static int cmd_top(const struct arguments *args)
+{
+	char *all[] = { "/*" };
+	char **patterns = args->qcount ? args->qnames : all;
+	int npatterns = args->qcount ? args->qcount : 1;
+	struct mqu_watched *watched = NULL;
+	int nwatched = 0;
+	int tty = isatty(1);
+
+	for (long sample = 0; !args->count || sample < args->count; sample++) {
+		char **qnames;
+		int qcount = mqu_expand_qnames(args, patterns, npatterns, &qnames, 1);
+		if (qcount < 0) return 1;
+
+		/* forget the queues that were deleted, open the new ones */
+		for (int i=0; i<nwatched; i++) watched[i].seen = (mqu_find_name(qnames, qcount, watched[i].qname) >= 0);
+		int kept = 0;
+		for (int i=0; i<nwatched; i++) {
+			if (watched[i].seen) {
+				watched[kept++] = watched[i];
 			} else {
-				LOG_ERR("poll revents != POLLIN (%x)", ufds[0].revents);
-				break;
+				mq_close(watched[i].queue);
+				free(watched[i].qname);
 			}
-		} else {
-			LOG_ERR("poll error(2): rv=%d", rv);
 		}
+		nwatched = kept;
+
+		for (int i=0; i<qcount; i++) {
+			int known = 0;
+			for (int j=0; j<nwatched && !known; j++) known = (0 == strcmp(watched[j].qname, qnames[i]));
+			if (known) continue;
+
+			LOG_VERBOSE(args, "Opening mq %s (O_RDONLY, O_NONBLOCK)", qnames[i]);
+			mqd_t queue = mq_open(qnames[i], O_RDONLY|O_NONBLOCK);
+			if (-1 == queue) {
+				LOG_VERBOSE(args, "mq_open error on %s: %s", qnames[i], strerror(errno));
+				continue;
+			}
+			watched = realloc(watched, (nwatched + 1) * sizeof(*watched));
+			memset(&watched[nwatched], 0, sizeof(*watched));
+			watched[nwatched].qname = strdup(qnames[i]);
+			watched[nwatched].queue = queue;
+			nwatched++;
+		}
+		mqu_free_names(qnames, qcount);
+		qsort(watched, nwatched, sizeof(*watched), mqu_cmp_watched);
+
+		if (tty) printf("\033[H\033[J");
+		else if (sample) printf("\n");
+		if (args->timestamp) {
+			char stamp[MQU_TIMESTAMP_MAX];
+			size_t len = mqu_timestamp(stamp, args->timestamp, args->coarse_time);
+			printf("%.*s ", (int)len, stamp);
+		}
+		printf("%-24s %8s %8s %6s %10s %10s %10s %8s %8s\n",
+		       "QUEUE", "DEPTH", "MAXMSG", "FILL%", "BYTES", "MSGS/S", "BYTES/S", "FULL IN", "NOTIFY");
+		for (int i=0; i<nwatched; i++) {
+			struct mqu_watched *w = &watched[i];
+			char full_in[32] = "-";
+
+			if (0 != mqu_watch_sample(args, w)) continue;
+
+			long room = w->attr.mq_maxmsg - w->attr.mq_curmsgs;
+			if (0 == room) snprintf(full_in, sizeof(full_in), "full");
+			else if (w->rate > 0) snprintf(full_in, sizeof(full_in), "%.1fs", room / w->rate);
+
+			printf("%-24s %8ld %8ld %6.1f %10ld %10.1f %10.1f %10s %8ld\n",
+			       w->qname, w->attr.mq_curmsgs, w->attr.mq_maxmsg,
+			       100.0 * w->attr.mq_curmsgs / w->attr.mq_maxmsg,
+			       w->qsize, w->rate, w->byte_rate, full_in, w->notify_pid);
+		}
+		fflush(stdout);
+
+		if (args->count && sample + 1 >= args->count) break;
+		struct timespec interval;
+		interval.tv_sec = (time_t)args->interval;
+		interval.tv_nsec = (long)((args->interval - interval.tv_sec) * 1e9);
+		nanosleep(&interval, NULL);
 	}
-	mq_close(queue);
-	return 1;
 
+	for (int i=0; i<nwatched; i++) {
+		mq_close(watched[i].queue);
+		free(watched[i].qname);
+	}
+	free(watched);
+	return 0;
+}
+
+/* State shared by the threads of a benchmark */
+struct mqu_bench {
+	const struct arguments *args;
+	const char *qname;
+	struct mqu_shm *shm; /* shared by the threads, with --transport=shm */
+	long msgsize;
+	atomic_long sent;    /* number of messages claimed by producers */
+	atomic_int stop;     /* set when the duration has elapsed */
+};
+
+struct mqu_bench_consumer {
+	pthread_t thread;
+	struct mqu_bench *bench;
+	uint64_t bytes;
+	struct mqu_histogram latency; /* nanoseconds from send to receive */
+	int error;
+};
+
+struct mqu_bench_producer {
+	pthread_t thread;
+	struct mqu_bench *bench;
+	int error;
+};
+
+/* Send messages carrying the time they were sent */
+static void *mqu_bench_produce(void *arg)
+{
+	struct mqu_bench_producer *producer = arg;
+	struct mqu_bench *bench = producer->bench;
+	const struct arguments *args = bench->args;
+	uint8_t *payload = malloc(args->payload);
+	mqd_t queue = -1;
+
+	if (!payload) {
+		LOG_ERR("Cannot allocate memory");
+		producer->error = 1;
+		return NULL;
+	}
+	if (!bench->shm) queue = mqu_open_wo(args, bench->qname);
+	if (!bench->shm && -1 == queue) {
+		producer->error = 1;
+		free(payload);
+		return NULL;
+	}
+	memset(payload, 'x', args->payload);
+
+	while (!atomic_load_explicit(&bench->stop, memory_order_relaxed)) {
+		long index = atomic_fetch_add(&bench->sent, 1);
+		if (args->count && index >= args->count) break;
+
+		uint64_t now = mqu_now_ns();
+		memcpy(payload, &now, sizeof(now));
+		int rv = bench->shm ? mqu_shm_send(bench->shm, NULL, payload, args->payload, args->priority, -1)
+		                    : mq_send(queue, (const char *)payload, args->payload, args->priority);
+		if (0 != rv) {
+			LOG_ERR("mq_send error: %s", strerror(errno));
+			producer->error = 1;
+			break;
+		}
+	}
+
+	free(payload);
+	if (-1 != queue) mq_close(queue);
+	return NULL;
+}
+
+/* Receive messages until an empty message arrives */
+static void *mqu_bench_consume(void *arg)
+{
+	struct mqu_bench_consumer *consumer = arg;
+	struct mqu_bench *bench = consumer->bench;
+	int wakeup = bench->args->wakeup;
+	struct mqu_poller poller;
+	uint8_t *buffer = malloc(bench->msgsize);
+	mqd_t queue = -1;
+
+	if (!buffer) {
+		LOG_ERR("Cannot allocate memory");
+		consumer->error = 1;
+		return NULL;
+	}
+	if (!bench->shm) queue = mqu_open_ro(bench->args, bench->qname);
+	if (!bench->shm && -1 == queue) {
+		consumer->error = 1;
+		free(buffer);
+		return NULL;
+	}
+
+	/* with poll or notify, wait only once the queue is drained */
+	if (MQU_WAKEUP_POLL == wakeup || MQU_WAKEUP_NOTIFY == wakeup) {
+		if (0 != mqu_poller_init(&poller, 1, wakeup)) {
+			consumer->error = 1;
+			mq_close(queue);
+			free(buffer);
+			return NULL;
+		}
+		if (0 != mqu_set_nonblock(queue) || 0 != mqu_poller_add(&poller, 0, queue)) {
+			consumer->error = 1;
+			mqu_poller_free(&poller);
+			mq_close(queue);
+			free(buffer);
+			return NULL;
+		}
+	}
+
+	while (1) {
+		ssize_t n = bench->shm ? mqu_shm_receive(bench->shm, NULL, buffer, bench->msgsize, NULL, -1)
+		                       : mq_receive(queue, (void*)buffer, bench->msgsize, NULL);
+		if (n < 0 && EAGAIN == errno) {
+			int index;
+			int rv = mqu_poller_rearm(&poller, 0);
+			if (0 == rv) rv = mqu_poller_wait(&poller, &index, -1);
+			if (rv >= 0) continue;
+			consumer->error = 1;
+			break;
+		}
+		if (n < 0) {
+			if (EINTR == errno) continue;
+			LOG_ERR("mq_receive error: %s", strerror(errno));
+			consumer->error = 1;
+			break;
+		}
+		if (0 == n) break;
+
+		uint64_t sent;
+		memcpy(&sent, buffer, sizeof(sent));
+		mqu_hist_add(&consumer->latency, mqu_now_ns() - sent);
+		consumer->bytes += n;
+	}
+
+	if (MQU_WAKEUP_POLL == wakeup || MQU_WAKEUP_NOTIFY == wakeup) mqu_poller_free(&poller);
+	free(buffer);
+	if (-1 != queue) mq_close(queue);
+	return NULL;
+}
+
+#define MQU_BENCH_STARTUP_RUNS 20
+
+/* Measure the time from fork to the reception of the message sent
+ * by "mq send", run MQU_BENCH_STARTUP_RUNS times
+ *
+ * Return the median in nanoseconds, 0 on error.
+ */
+static uint64_t mqu_bench_startup(const char *qname, size_t msgsize)
+{
+	struct mqu_histogram *hist = calloc(1, sizeof(*hist));
+	char *buffer = malloc(msgsize);
+	uint64_t median = 0;
+
+	mqd_t queue = mq_open(qname, O_RDONLY);
+	if (!hist || !buffer || -1 == queue) goto end;
+
+	for (int i=0; i<MQU_BENCH_STARTUP_RUNS; i++) {
+		char *argv[] = { PROG_NAME, "send", (char *)qname, "x", NULL };
+		uint64_t start = mqu_now_ns();
+		pid_t pid = fork();
+		if (pid < 0) goto end;
+		if (0 == pid) {
+			execv("/proc/self/exe", argv);
+			_exit(127);
+		}
+		struct timespec deadline;
+		mqu_deadline(&deadline, 5000000000LL);
+		ssize_t n = mq_timedreceive(queue, buffer, msgsize, NULL, &deadline);
+		uint64_t end = mqu_now_ns();
+		waitpid(pid, NULL, 0);
+		if (n < 0) goto end;
+		mqu_hist_add(hist, end - start);
+	}
+	median = mqu_hist_percentile(hist, 50);
+
+end:
+	if (-1 != queue) mq_close(queue);
+	free(buffer);
+	free(hist);
+	return median;
+}
+
+/* Run the benchmark with a queue of the options for create
+ *
+ * The startup time is measured once per invocation, by the first run
+ * with a message queue, and kept in *startup for the next runs.
+ */
+static int mqu_bench_run(const struct arguments *args_in, uint64_t *startup)
+{
+	struct arguments args = *args_in;
+	struct mqu_bench bench;
+	struct mqu_bench_producer *producers;
+	struct mqu_bench_consumer *consumers;
+	struct mqu_histogram *latency;
+	char qname[64];
+	mqd_t queue;
+	int ret = 0;
+	int nprod = 0, ncons = 0;
+
+	if (args.payload < 0) args.payload = args.msgsize;
+	if (args.producers < 1 || args.consumers < 1) {
+		LOG_ERR("At least one producer and one consumer are needed");
+		return 1;
+	}
+	if (args.payload < (int)sizeof(uint64_t) || args.payload > args.msgsize) {
+		LOG_ERR("Invalid payload size %d (must be from %zu to msgsize)", args.payload, sizeof(uint64_t));
+		return 1;
+	}
+	if (MQU_WAKEUP_NOTIFY == args.wakeup && args.consumers > 1) {
+		LOG_ERR("--wakeup=notify can only be used with a single consumer");
+		return 1;
+	}
+	/* the queue is only used by the benchmark threads */
+	args.blocking = 1;
+
+	snprintf(qname, sizeof(qname), "/" PROG_NAME "-bench-%d", (int)getpid());
+	bench.shm = NULL;
+	queue = -1;
+	if (MQU_TRANSPORT_SHM == args.transport) bench.shm = mqu_open_shm(&args, qname, O_RDWR|O_CREAT|O_EXCL);
+	else queue = mqu_create(&args, qname, O_WRONLY);
+	if (!bench.shm && -1 == queue) return 1;
+
+	bench.args = &args;
+	bench.qname = qname;
+	bench.msgsize = args.msgsize;
+	atomic_init(&bench.sent, 0);
+	atomic_init(&bench.stop, 0);
+
+	producers = calloc(args.producers, sizeof(*producers));
+	consumers = calloc(args.consumers, sizeof(*consumers));
+	latency = calloc(1, sizeof(*latency));
+	if (!producers || !consumers || !latency) {
+		LOG_ERR("Cannot allocate memory");
+		ret = 1;
+		goto end;
+	}
+
+	uint64_t start = mqu_now_ns();
+
+	for (ncons=0; ncons<args.consumers; ncons++) {
+		consumers[ncons].bench = &bench;
+		if (0 != pthread_create(&consumers[ncons].thread, NULL, mqu_bench_consume, &consumers[ncons])) {
+			LOG_ERR("pthread_create error");
+			ret = 1;
+			break;
+		}
+	}
+	for (nprod=0; 0 == ret && nprod<args.producers; nprod++) {
+		producers[nprod].bench = &bench;
+		if (0 != pthread_create(&producers[nprod].thread, NULL, mqu_bench_produce, &producers[nprod])) {
+			LOG_ERR("pthread_create error");
+			ret = 1;
+			break;
+		}
+	}
+
+	if (0 == ret && 0 == args.count) {
+		struct timespec duration;
+		duration.tv_sec = (time_t)args.duration;
+		duration.tv_nsec = (long)((args.duration - duration.tv_sec) * 1e9);
+		while (0 != nanosleep(&duration, &duration) && EINTR == errno);
+	}
+	/* with a count, producers stop by themselves */
+	if (0 != ret || 0 == args.count) atomic_store(&bench.stop, 1);
+
+	for (int i=0; i<nprod; i++) {
+		pthread_join(producers[i].thread, NULL);
+		if (producers[i].error) ret = 1;
+	}
+
+	/* an empty message tells a consumer to stop */
+	for (int i=0; i<ncons; i++) {
+		int rv = bench.shm ? mqu_shm_send(bench.shm, NULL, "", 0, 0, -1) : mq_send(queue, "", 0, 0);
+		if (0 != rv) {
+			LOG_ERR("mq_send error: %s", strerror(errno));
+			pthread_cancel(consumers[i].thread);
+		}
+	}
+
+	uint64_t bytes = 0;
+	for (int i=0; i<ncons; i++) {
+		pthread_join(consumers[i].thread, NULL);
+		if (consumers[i].error) ret = 1;
+		mqu_hist_merge(latency, &consumers[i].latency);
+		bytes += consumers[i].bytes;
+	}
+
+	double seconds = (mqu_now_ns() - start) / 1e9;
+
+	/* startup of a short-lived "mq send", on the queue left empty */
+	if (!bench.shm && 0 == ret && !*startup) {
+		*startup = mqu_bench_startup(qname, args.msgsize);
+		if (!*startup) LOG_ERR("Cannot measure the startup time: %s", strerror(errno));
+	}
+
+	const char *fmt;
+	switch (args.format) {
+	case MQU_FMT_JSON:
+		fmt = "{\"version\":\"" PACKAGE_VERSION "\",\"transport\":\"%s\",\"producers\":%d,\"consumers\":%d,"
+		      "\"maxmsg\":%d,\"msgsize\":%d,\"payload\":%d,\"messages\":%llu,\"seconds\":%.3f,"
+		      "\"msgs_per_s\":%.0f,\"mb_per_s\":%.2f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p99_9_us\":%.1f,"
+		      "\"max_us\":%.1f,\"startup_us\":%.1f}\n";
+		break;
+	case MQU_FMT_CSV:
+		fmt = PACKAGE_VERSION ",%s,%d,%d,%d,%d,%d,%llu,%.3f,%.0f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f\n";
+		break;
+	default:
+		printf("%s: ", qname);
+		fmt = "transport=%s, producers=%d, consumers=%d, maxmsg=%d, msgsize=%d, payload=%d, "
+		      "messages=%llu, seconds=%.3f, msgs/s=%.0f, MB/s=%.2f, "
+		      "p50=%.1fus, p99=%.1fus, p99.9=%.1fus, max=%.1fus, startup=%.1fus\n";
+		break;
+	}
+	printf(fmt, bench.shm ? "shm" : "mq", args.producers, args.consumers, args.maxmsg, args.msgsize,
+	       args.payload, (unsigned long long)latency->count, seconds, latency->count / seconds,
+	       bytes / seconds / 1e6,
+	       mqu_hist_percentile(latency, 50) / 1e3,
+	       mqu_hist_percentile(latency, 99) / 1e3,
+	       mqu_hist_percentile(latency, 99.9) / 1e3,
+	       latency->max / 1e3, *startup / 1e3);
+	fflush(stdout);
+
+end:
+	free(latency);
+	free(consumers);
+	free(producers);
+	if (bench.shm) {
+		mqu_shm_close(bench.shm);
+		mqu_shm_unlink(qname);
+	} else {
+		mq_close(queue);
+		mq_unlink(qname);
+	}
+	return ret;
+}
+
+/* Next value of a sweep, ending with last */
+static long mqu_sweep_next(long value, long factor, long last)
+{
+	if (value >= last) return last + 1;
+	return (value * factor < last) ? value * factor : last;
+}
+
+/* Run the benchmark over message sizes, queue depths and thread counts
+ *
+ * The sizes grow by 4 from 16 bytes, and the depths by 10 from 1, up to
+ * the limits of the system. The queues that do not fit in what is left
+ * of RLIMIT_MSGQUEUE are skipped.
+ */
+static int mqu_bench_sweep(const struct arguments *args_in)
+{
+	static const int threads[][2] = { { 1, 1 }, { 1, 4 }, { 4, 1 }, { 4, 4 } };
+	struct arguments args = *args_in;
+	struct mqu_limits limits;
+	uint64_t startup = 0;
+	int ret = 0;
+
+	mqu_read_limits(&limits);
+	long msgsize_max = (limits.msgsize_max > 0) ? limits.msgsize_max : args_in->msgsize;
+	long msg_max = (limits.msg_max > 0) ? limits.msg_max : args_in->maxmsg;
+	uint64_t used = mqu_user_queue_bytes("");
+	uint64_t budget = RLIM_INFINITY == limits.rlimit.rlim_cur ? UINT64_MAX
+	                  : (limits.rlimit.rlim_cur > used ? limits.rlimit.rlim_cur - used : 0);
+
+	long first_size = args.msgsize_given ? args.msgsize : 16;
+	long last_size = args.msgsize_given ? args.msgsize : msgsize_max;
+	long first_depth = args.maxmsg_given ? args.maxmsg : 1;
+	long last_depth = args.maxmsg_given ? args.maxmsg : msg_max;
+
+	for (long size = first_size; size <= last_size; size = mqu_sweep_next(size, 4, last_size)) {
+		for (long depth = first_depth; depth <= last_depth; depth = mqu_sweep_next(depth, 10, last_depth)) {
+			if (MQU_TRANSPORT_SHM != args.transport && mqu_queue_bytes(depth, size) > budget) {
+				LOG_VERBOSE(args_in, "Skipping maxmsg=%ld, msgsize=%ld: over RLIMIT_MSGQUEUE", depth, size);
+				continue;
+			}
+			for (size_t i=0; i<sizeof(threads)/sizeof(threads[0]); i++) {
+				args.msgsize = size;
+				args.maxmsg = depth;
+				args.payload = -1;
+				args.producers = threads[i][0];
+				args.consumers = threads[i][1];
+				/* notify wakes up a single consumer */
+				if (MQU_WAKEUP_NOTIFY == args.wakeup && args.consumers > 1) continue;
+				if (0 != mqu_bench_run(&args, &startup)) ret = 1;
+			}
+		}
+	}
+	return ret;
+}
+
+static int cmd_bench(const struct arguments *args)
+{
+	if (MQU_FMT_CSV == args->format) {
+		printf("version,transport,producers,consumers,maxmsg,msgsize,payload,messages,seconds,"
+		       "msgs_per_s,mb_per_s,p50_us,p99_us,p99_9_us,max_us,startup_us\n");
+	}
+	if (args->sweep) return mqu_bench_sweep(args);
+	uint64_t startup = 0;
+	return mqu_bench_run(args, &startup);
+}
+
+/* Fast path of "send QNAME MESSAGE" without options, for scripts that
+ * run mq many times: no argument parsing, no allocation, no stdio
+ *
+ * Return the exit status, or -1 to take the normal path, which also
+ * reports the errors of mq_open.
+ */
+static int mqu_fast_send(int argc, char **argv)
+{
+	if (4 != argc || 0 != strcmp("send", argv[1]) || '/' != argv[2][0] || '-' == argv[3][0]) return -1;
+
+	mqd_t queue = mq_open(argv[2], O_WRONLY);
+	if (-1 == queue) return -1;
+	int ret = 0;
+	if (0 != mq_send(queue, argv[3], strlen(argv[3]), 0)) {
+		LOG_ERR("mq_send error: %s", strerror(errno));
+		ret = 1;
+	}
+	mq_close(queue);
+	return ret;
 }
 
 int main(int argc, char **argv)
@@ -374,29 +4605,121 @@ int main(int argc, char **argv)
 	struct arguments args;
 	struct argp argp = { options, parse_opt, args_doc, doc };
 
+	int fast = mqu_fast_send(argc, argv);
+	if (fast >= 0) return fast;
+
 	/* Default values */
 	args.verbose = 0;
+	args.stats = 0;
+	args.stats_interval = 0;
+	args.stats_file = NULL;
+	args.stats_data = NULL;
+	args.timeout = -1;
+	args.transport = MQU_TRANSPORT_MQ;
 	args.command = NULL;
 	args.qname = NULL;
+	args.qnames = calloc(argc, sizeof(char *));
+	args.qcount = 0;
 	args.maxmsg = 10;
 	args.msgsize = 1024;
-	args.timestamp = 0;
+	args.maxmsg_given = 0;
+	args.msgsize_given = 0;
+	args.mode = 0644;
+	args.auto_size = 0;
+	args.sample_file = NULL;
+	args.timestamp = MQU_TS_NONE;
+	args.coarse_time = 0;
 	args.blocking = 1;
 	args.follow = 0;
+	args.print_name = 0;
+	args.print_priority = 0;
+	args.workers = 1;
+	args.ordered = 0;
+	args.min_priority = 0;
+	args.format = MQU_FMT_RAW;
+	args.wakeup = MQU_WAKEUP_AUTO;
+	args.zero_copy = 0;
 	args.message = NULL;
 	args.msglen = 0;
 	args.priority = 0;
+	args.from_stdin = 0;
+	args.threads = 1;
+	args.rate = 0;
+	args.producers = 1;
+	args.consumers = 1;
+	args.duration = 1;
+	args.count = 0;
+	args.payload = -1;
+	args.sweep = 0;
+	args.interval = 1;
+	args.all = 0;
+	args.file = NULL;
+	args.speed = 1;
 	args.delimiter = '\n';
+	args.framing = MQU_FRAMING_NONE;
+	args.pack = 0;
+	args.linger = 0;
+	args.compress = -1;
+	args.busy_poll = 0;
+	args.ncpus = 0;
+	args.sched_policy = -1;
+	args.sched_priority = 0;
+	args.mlock = 0;
+	memset(&args.filter, 0, sizeof(args.filter));
+	args.routes = NULL;
+	args.nroutes = 0;
+	args.dictionary_file = NULL;
+	args.dictionary = NULL;
+	args.dictionary_len = 0;
 
 	argp_parse(&argp, argc, argv, 0, 0, &args);
 
-	if (0 == strcmp(args.command, "create")) return cmd_create(&args);
-	else if (0 == strcmp(args.command, "info")) return cmd_info(&args);
-	else if (0 == strcmp(args.command, "unlink")) return cmd_unlink(&args);
-	else if (0 == strcmp(args.command, "send")) return cmd_send(&args);
+	if (MQU_WAKEUP_NOTIFY == args.wakeup) mqu_notify_block();
+
+	if (args.dictionary_file && 0 != mqu_read_file(args.dictionary_file, &args.dictionary, &args.dictionary_len)) {
+		LOG_ERR("Cannot read %s: %s", args.dictionary_file, strerror(errno));
+		return 1;
+	}
+
+	FILE *stats_out = stderr;
+	if (args.stats) {
+		if (args.stats_file) {
+			stats_out = fopen(args.stats_file, "a");
+			if (!stats_out) {
+				LOG_ERR("Cannot open %s: %s", args.stats_file, strerror(errno));
+				return 1;
+			}
+		}
+		args.stats_data = mqu_stats_new(stats_out, args.stats_interval);
+	}
+
+	int ret = 1;
+	if (0 == strcmp(args.command, "create")) ret = cmd_create(&args);
+	else if (0 == strcmp(args.command, "info")) ret = cmd_info(&args);
+	else if (0 == strcmp(args.command, "unlink")) ret = cmd_unlink(&args);
+	else if (0 == strcmp(args.command, "send") && MQU_TRANSPORT_SHM == args.transport) ret = cmd_send_shm(&args);
+	else if (0 == strcmp(args.command, "send")) ret = cmd_send(&args);
 	else if (0 == strcmp(args.command, "recv")) {
-	   if (args.follow) return cmd_recv_follow(&args);
-	   else return cmd_recv(&args);
+	   if (MQU_TRANSPORT_SHM == args.transport) ret = cmd_recv_shm(&args);
+	   else if (args.follow && args.workers > 1) ret = cmd_recv_workers(&args);
+	   else if (args.follow) ret = cmd_recv_follow(&args);
+	   else ret = cmd_recv(&args);
 	}
+	else if (0 == strcmp(args.command, "relay")) ret = cmd_relay(&args);
+	else if (0 == strcmp(args.command, "record")) ret = cmd_record(&args);
+	else if (0 == strcmp(args.command, "replay")) ret = cmd_replay(&args);
+	else if (0 == strcmp(args.command, "top")) ret = cmd_top(&args);
+	else if (0 == strcmp(args.command, "bench")) ret = cmd_bench(&args);
 	else usage(&argp);
+
+	if (args.stats_data) mqu_stats_free(args.stats_data);
+	if (stats_out != stderr) fclose(stats_out);
+	free(args.dictionary);
+	if (args.filter.regex) {
+		regfree(args.filter.regex);
+		free(args.filter.regex);
+	}
+	for (int i=0; i<args.nroutes; i++) regfree(&args.routes[i].regex);
+	free(args.routes);
+	return ret;
 }
@@ -0,0 +1,404 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "libmq.h"
+
+/* Queues in shared memory
+ *
+ * The shared memory object holds a header, then one ring of cells per
+ * priority lane. Each ring is a bounded MPMC queue where every cell
+ * carries a sequence number (as described by D. Vyukov): a cell at
+ * position pos is free when seq == pos, and full when seq == pos + 1.
+ *
+ * The depth of the whole queue is bounded by maxmsg with a counter
+ * reserved by senders before they enqueue, so a lane, whose capacity
+ * is at least maxmsg, is never full. Sleeping uses a futex per side,
+ * and a side only makes the wake syscall when the other one is waiting.
+ */
+#define MQU_SHM_MAGIC 0x316d687375716dULL /* "mqushm1" */
+#define MQU_SHM_CACHE_LINE 64
+
+struct mqu_shm_cell {
+	atomic_ullong seq;
+	uint32_t prio;
+	uint32_t len;
+	uint8_t data[];
+};
+
+struct mqu_shm_lane {
+	_Alignas(MQU_SHM_CACHE_LINE) atomic_ullong head; /* next position to enqueue */
+	_Alignas(MQU_SHM_CACHE_LINE) atomic_ullong tail; /* next position to dequeue */
+};
+
+struct mqu_shm_header {
+	atomic_ullong magic; /* set once the queue is initialized */
+	uint64_t size; /* of the shared memory object */
+	uint64_t maxmsg;
+	uint64_t msgsize;
+	uint64_t capacity; /* cells per lane, a power of 2 */
+	uint64_t cell_size;
+	_Alignas(MQU_SHM_CACHE_LINE) atomic_long count; /* messages queued or being queued */
+	_Alignas(MQU_SHM_CACHE_LINE) atomic_uint recv_futex;
+	atomic_uint recv_waiters;
+	_Alignas(MQU_SHM_CACHE_LINE) atomic_uint send_futex;
+	atomic_uint send_waiters;
+	struct mqu_shm_lane lanes[MQU_SHM_LANES];
+};
+
+struct mqu_shm {
+	struct mqu_shm_header *header;
+	uint8_t *cells;
+	size_t size;
+	int access; /* O_RDONLY, O_WRONLY or O_RDWR */
+	int nonblock;
+};
+
+/* The shared memory object of a queue: "/name" is "/mq.name" */
+static int mqu_shm_name(char *buffer, size_t size, const char *name)
+{
+	if ('/' != name[0] || !name[1] || strchr(name + 1, '/')) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((size_t)snprintf(buffer, size, "/mq.%s", name + 1) >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+static struct mqu_shm_cell *mqu_shm_cell(const struct mqu_shm *shm, int lane, uint64_t pos)
+{
+	const struct mqu_shm_header *h = shm->header;
+	return (struct mqu_shm_cell *)(shm->cells + (lane * h->capacity + (pos & (h->capacity - 1))) * h->cell_size);
+}
+
+static void mqu_shm_init(struct mqu_shm_header *h, uint64_t size, const struct mq_attr *attr,
+                         uint64_t capacity, uint64_t cell_size, uint8_t *cells)
+{
+	h->size = size;
+	h->maxmsg = attr->mq_maxmsg;
+	h->msgsize = attr->mq_msgsize;
+	h->capacity = capacity;
+	h->cell_size = cell_size;
+	atomic_init(&h->count, 0);
+	atomic_init(&h->recv_futex, 0);
+	atomic_init(&h->recv_waiters, 0);
+	atomic_init(&h->send_futex, 0);
+	atomic_init(&h->send_waiters, 0);
+	for (int lane=0; lane<MQU_SHM_LANES; lane++) {
+		atomic_init(&h->lanes[lane].head, 0);
+		atomic_init(&h->lanes[lane].tail, 0);
+		for (uint64_t i=0; i<capacity; i++) {
+			struct mqu_shm_cell *cell = (struct mqu_shm_cell *)(cells + (lane * capacity + i) * cell_size);
+			atomic_init(&cell->seq, i);
+		}
+	}
+	atomic_store_explicit(&h->magic, MQU_SHM_MAGIC, memory_order_release);
+}
+
+struct mqu_shm *mqu_shm_open(const char *name, int oflag, mode_t mode, const struct mq_attr *attr)
+{
+#ifdef HAVE_LINUX_FUTEX_H
+	static const struct mq_attr defaults = { 0, 10, 8192, 0 };
+	char shm_name[256];
+	struct stat st;
+	int created = 0;
+	int fd;
+
+	if (0 != mqu_shm_name(shm_name, sizeof(shm_name), name)) return NULL;
+	if (!attr) attr = &defaults;
+
+	/* senders and receivers both update the indexes, so only the handles
+	 * opened O_RDONLY, which read the attributes, map it read-only; the
+	 * creator maps it read-write to initialize it */
+	int access = oflag & O_ACCMODE;
+	int writable = (O_RDONLY != access) || (oflag & O_CREAT);
+	fd = shm_open(shm_name, (writable ? O_RDWR : O_RDONLY) | (oflag & (O_CREAT|O_EXCL)), mode);
+	if (fd < 0) return NULL;
+	if (0 != fstat(fd, &st)) goto error;
+	created = (oflag & O_CREAT) && 0 == st.st_size;
+
+	uint64_t capacity = 1;
+	uint64_t cell_size = (sizeof(struct mqu_shm_cell) + attr->mq_msgsize + MQU_SHM_CACHE_LINE - 1)
+	                     & ~(uint64_t)(MQU_SHM_CACHE_LINE - 1);
+	uint64_t size = st.st_size;
+	if (created) {
+		if (attr->mq_maxmsg <= 0 || attr->mq_msgsize <= 0) {
+			errno = EINVAL;
+			goto error;
+		}
+		while (capacity < (uint64_t)attr->mq_maxmsg) capacity *= 2;
+		size = sizeof(struct mqu_shm_header) + MQU_SHM_LANES * capacity * cell_size;
+		if (0 != ftruncate(fd, size)) goto error;
+	} else if (size < sizeof(struct mqu_shm_header)) {
+		/* being created by another process */
+		for (int i=0; i<1000 && size < sizeof(struct mqu_shm_header); i++) {
+			usleep(1000);
+			if (0 != fstat(fd, &st)) goto error;
+			size = st.st_size;
+		}
+		if (size < sizeof(struct mqu_shm_header)) {
+			errno = EINVAL;
+			goto error;
+		}
+	}
+
+	void *map = mmap(NULL, size, writable ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == map) goto error;
+	struct mqu_shm *shm = malloc(sizeof(*shm));
+	if (!shm) {
+		munmap(map, size);
+		errno = ENOMEM;
+		goto error;
+	}
+	close(fd);
+
+	shm->header = map;
+	shm->cells = (uint8_t *)map + sizeof(struct mqu_shm_header);
+	shm->size = size;
+	shm->access = access;
+	shm->nonblock = (0 != (oflag & O_NONBLOCK));
+
+	if (created) {
+		mqu_shm_init(shm->header, size, attr, capacity, cell_size, shm->cells);
+	} else {
+		for (int i=0; i<1000 && MQU_SHM_MAGIC != atomic_load(&shm->header->magic); i++) usleep(1000);
+		if (MQU_SHM_MAGIC != atomic_load(&shm->header->magic) || shm->header->size != size) {
+			mqu_shm_close(shm);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+	return shm;
+
+error: {
+		int saved_errno = errno;
+		if (created) shm_unlink(shm_name);
+		close(fd);
+		errno = saved_errno;
+		return NULL;
+	}
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+void mqu_shm_close(struct mqu_shm *shm)
+{
+	munmap(shm->header, shm->size);
+	free(shm);
+}
+
+int mqu_shm_unlink(const char *name)
+{
+	char shm_name[256];
+	if (0 != mqu_shm_name(shm_name, sizeof(shm_name), name)) return -1;
+	return shm_unlink(shm_name);
+}
+
+int mqu_shm_getattr(const struct mqu_shm *shm, struct mq_attr *attr)
+{
+	long count = atomic_load(&shm->header->count);
+	attr->mq_flags = shm->nonblock ? O_NONBLOCK : 0;
+	attr->mq_maxmsg = shm->header->maxmsg;
+	attr->mq_msgsize = shm->header->msgsize;
+	attr->mq_curmsgs = count > 0 ? count : 0;
+	return 0;
+}
+
+#ifdef HAVE_LINUX_FUTEX_H
+/* The futexes are shared by processes, so they are not FUTEX_PRIVATE */
+static int mqu_futex_wait(atomic_uint *futex, unsigned value, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, (unsigned *)futex, FUTEX_WAIT, value, timeout, NULL, 0);
+}
+
+static void mqu_futex_wake(atomic_uint *futex, atomic_uint *waiters)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (0 == atomic_load_explicit(waiters, memory_order_relaxed)) return;
+	atomic_fetch_add(futex, 1);
+	syscall(SYS_futex, (unsigned *)futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static int mqu_shm_try_send(struct mqu_shm *shm, const void *data, size_t len, unsigned prio)
+{
+	struct mqu_shm_header *h = shm->header;
+
+	if (atomic_fetch_add(&h->count, 1) >= (long)h->maxmsg) {
+		atomic_fetch_sub(&h->count, 1);
+		return -1;
+	}
+
+	int lane = prio < MQU_SHM_LANES ? (int)prio : MQU_SHM_LANES - 1;
+	struct mqu_shm_lane *l = &h->lanes[lane];
+	struct mqu_shm_cell *cell;
+	uint64_t pos = atomic_load_explicit(&l->head, memory_order_relaxed);
+	while (1) {
+		cell = mqu_shm_cell(shm, lane, pos);
+		uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		int64_t dif = (int64_t)(seq - pos);
+		if (0 == dif) {
+			if (atomic_compare_exchange_weak_explicit(&l->head, &pos, pos + 1,
+			                                          memory_order_relaxed, memory_order_relaxed)) break;
+		} else {
+			/* another sender took the cell, or a receiver still copies it out */
+			pos = atomic_load_explicit(&l->head, memory_order_relaxed);
+		}
+	}
+
+	cell->prio = prio;
+	cell->len = len;
+	memcpy(cell->data, data, len);
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+	mqu_futex_wake(&h->recv_futex, &h->recv_waiters);
+	return 0;
+}
+
+static ssize_t mqu_shm_try_receive(struct mqu_shm *shm, void *buffer, unsigned *prio)
+{
+	struct mqu_shm_header *h = shm->header;
+
+	if (atomic_load_explicit(&h->count, memory_order_relaxed) <= 0) return -1;
+
+	/* the highest lanes first, as mq_receive does with priorities */
+	for (int lane=MQU_SHM_LANES-1; lane>=0; lane--) {
+		struct mqu_shm_lane *l = &h->lanes[lane];
+		uint64_t pos = atomic_load_explicit(&l->tail, memory_order_relaxed);
+		while (1) {
+			struct mqu_shm_cell *cell = mqu_shm_cell(shm, lane, pos);
+			uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+			int64_t dif = (int64_t)(seq - (pos + 1));
+			if (dif < 0) break; /* empty lane */
+			if (dif > 0) {
+				pos = atomic_load_explicit(&l->tail, memory_order_relaxed);
+				continue;
+			}
+			if (!atomic_compare_exchange_weak_explicit(&l->tail, &pos, pos + 1,
+			                                           memory_order_relaxed, memory_order_relaxed)) continue;
+
+			size_t len = cell->len;
+			if (prio) *prio = cell->prio;
+			memcpy(buffer, cell->data, len);
+			atomic_store_explicit(&cell->seq, pos + h->capacity, memory_order_release);
+			atomic_fetch_sub(&h->count, 1);
+
+			mqu_futex_wake(&h->send_futex, &h->send_waiters);
+			return len;
+		}
+	}
+	return -1;
+}
+
+/* Sleep until the futex changes from value, or the deadline (monotonic
+ * nanoseconds, 0 for none) passes
+ *
+ * Return 0 when the caller should try again, -1 on timeout or signal.
+ */
+static int mqu_shm_sleep(atomic_uint *futex, unsigned value, uint64_t deadline)
+{
+	struct timespec left, *timeout = NULL;
+	if (deadline) {
+		uint64_t now = mqu_now_ns();
+		if (now >= deadline) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		left.tv_sec = (deadline - now) / 1000000000;
+		left.tv_nsec = (deadline - now) % 1000000000;
+		timeout = &left;
+	}
+	if (0 != mqu_futex_wait(futex, value, timeout) && EINTR == errno) return -1;
+	return 0;
+}
+#endif
+
+int mqu_shm_send(struct mqu_shm *shm, struct mqu_stats *stats, const void *data, size_t len, unsigned prio,
+                 int64_t timeout)
+{
+#ifdef HAVE_LINUX_FUTEX_H
+	uint64_t start = mqu_stats_start(stats);
+	int rv = -1;
+
+	if (O_RDONLY == shm->access) {
+		errno = EBADF;
+	} else if (len > shm->header->msgsize) {
+		errno = EMSGSIZE;
+	} else if (0 == (rv = mqu_shm_try_send(shm, data, len, prio))) {
+		/* sent without waiting */
+	} else if (0 == timeout || (timeout < 0 && shm->nonblock)) {
+		errno = EAGAIN;
+	} else {
+		struct mqu_shm_header *h = shm->header;
+		uint64_t deadline = timeout > 0 ? mqu_now_ns() + timeout : 0;
+		atomic_fetch_add(&h->send_waiters, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		while (1) {
+			unsigned value = atomic_load(&h->send_futex);
+			if (0 == (rv = mqu_shm_try_send(shm, data, len, prio))) break;
+			if (0 != mqu_shm_sleep(&h->send_futex, value, deadline)) break;
+		}
+		atomic_fetch_sub(&h->send_waiters, 1);
+	}
+	mqu_stats_record(stats, MQU_STATS_SEND, start, rv ? -1 : (ssize_t)len, prio);
+	return rv;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+ssize_t mqu_shm_receive(struct mqu_shm *shm, struct mqu_stats *stats, void *buffer, size_t size, unsigned *prio,
+                        int64_t timeout)
+{
+#ifdef HAVE_LINUX_FUTEX_H
+	unsigned priority = 0;
+	uint64_t start = mqu_stats_start(stats);
+	ssize_t n = -1;
+
+	if (O_RDWR != shm->access) {
+		errno = EBADF;
+	} else if (size < shm->header->msgsize) {
+		errno = EMSGSIZE;
+	} else if ((n = mqu_shm_try_receive(shm, buffer, &priority)) >= 0) {
+		/* received without waiting */
+	} else if (0 == timeout || (timeout < 0 && shm->nonblock)) {
+		errno = EAGAIN;
+	} else {
+		struct mqu_shm_header *h = shm->header;
+		uint64_t deadline = timeout > 0 ? mqu_now_ns() + timeout : 0;
+		atomic_fetch_add(&h->recv_waiters, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		while (1) {
+			unsigned value = atomic_load(&h->recv_futex);
+			if ((n = mqu_shm_try_receive(shm, buffer, &priority)) >= 0) break;
+			if (0 != mqu_shm_sleep(&h->recv_futex, value, deadline)) break;
+		}
+		atomic_fetch_sub(&h->recv_waiters, 1);
+	}
+	mqu_stats_record(stats, MQU_STATS_RECV, start, n, priority);
+	if (prio) *prio = priority;
+	return n;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
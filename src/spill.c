@@ -0,0 +1,460 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libmq.h"
+
+/* Spilling to disk
+ *
+ * The spill of queue "/name" in a directory is a series of segment
+ * files "name.SEQ.spill", plus "name.lock" which is locked by the
+ * process using the spill. Each segment is mapped, has a header with
+ * the offsets of writing and reading, and holds records appended one
+ * after the other: [length][priority][payload], padded to 8 bytes.
+ *
+ * Messages are appended to the newest segment, and re-injected from
+ * the oldest one by a drainer thread, which removes the segments it
+ * has drained. As the read offset is kept in the segment, the
+ * messages that are left when the process exits are re-injected by
+ * the next spill, before any new message.
+ */
+#define MQU_SPILL_MAGIC 0x316c6c697073716dULL /* "mqspill1" */
+#define MQU_SPILL_SEGMENT (16 << 20) /* default size of a segment */
+#define MQU_SPILL_POLL_MS 100 /* how often the drainer checks for closing */
+
+struct mqu_spill_header {
+	uint64_t magic;
+	uint64_t size; /* of the segment file */
+	uint64_t write_off; /* end of the records */
+	uint64_t read_off; /* next record to re-inject */
+	uint64_t sealed; /* no more records are appended */
+	uint64_t reserved[3];
+};
+
+struct mqu_spill_record {
+	uint32_t len;
+	uint32_t prio;
+	uint8_t data[];
+};
+
+struct mqu_spill_segment {
+	struct mqu_spill_header *header;
+	unsigned long seq;
+	struct mqu_spill_segment *next;
+};
+
+struct mqu_spill {
+	char *dir;
+	char *base; /* name of the queue, without the leading '/' */
+	mqd_t mqd;
+	struct mqu_stats *stats;
+	size_t segment_size;
+	int lock_fd;
+
+	pthread_t drainer;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct mqu_spill_segment *first; /* oldest segment, being drained */
+	struct mqu_spill_segment *last; /* newest segment, being appended to */
+	unsigned long next_seq;
+	size_t pending; /* messages spilled and not yet re-injected */
+	int closing; /* 1: drain then stop, 2: stop now */
+	int error; /* errno of the drainer, which stopped */
+};
+
+static size_t mqu_spill_record_size(size_t len)
+{
+	return (sizeof(struct mqu_spill_record) + len + 7) & ~(size_t)7;
+}
+
+static void mqu_spill_path(const struct mqu_spill *spill, char *buffer, size_t size, unsigned long seq)
+{
+	snprintf(buffer, size, "%s/%s.%06lu.spill", spill->dir, spill->base, seq);
+}
+
+/* Map segment seq, which is created if create is set */
+static struct mqu_spill_segment *mqu_spill_map(struct mqu_spill *spill, unsigned long seq, int create)
+{
+	char path[4096];
+	struct stat st;
+	int fd;
+
+	mqu_spill_path(spill, path, sizeof(path), seq);
+	fd = open(path, O_RDWR | (create ? O_CREAT|O_EXCL : 0), 0600);
+	if (fd < 0) return NULL;
+
+	size_t size = spill->segment_size;
+	if (create) {
+		if (0 != ftruncate(fd, size)) goto error;
+	} else {
+		if (0 != fstat(fd, &st)) goto error;
+		size = st.st_size;
+		if (size < sizeof(struct mqu_spill_header)) {
+			errno = EINVAL;
+			goto error;
+		}
+	}
+
+	struct mqu_spill_header *h = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == h) goto error;
+	close(fd);
+	fd = -1;
+
+	if (create) {
+		memset(h, 0, sizeof(*h));
+		h->magic = MQU_SPILL_MAGIC;
+		h->size = size;
+		h->write_off = sizeof(*h);
+		h->read_off = sizeof(*h);
+	} else if (MQU_SPILL_MAGIC != h->magic || h->size != size || h->write_off > size
+	           || h->read_off > h->write_off || h->read_off < sizeof(*h)) {
+		munmap(h, size);
+		errno = EINVAL;
+		goto error;
+	}
+
+	struct mqu_spill_segment *segment = malloc(sizeof(*segment));
+	if (!segment) {
+		munmap(h, size);
+		errno = ENOMEM;
+		goto error;
+	}
+	segment->header = h;
+	segment->seq = seq;
+	segment->next = NULL;
+	return segment;
+
+error: {
+		int saved_errno = errno;
+		if (fd >= 0) close(fd);
+		if (create) unlink(path);
+		errno = saved_errno;
+		return NULL;
+	}
+}
+
+/* Unmap a segment, and remove its file if remove is set */
+static void mqu_spill_unmap(struct mqu_spill *spill, struct mqu_spill_segment *segment, int remove)
+{
+	char path[4096];
+
+	if (remove) {
+		mqu_spill_path(spill, path, sizeof(path), segment->seq);
+		unlink(path);
+	}
+	munmap(segment->header, segment->header->size);
+	free(segment);
+}
+
+static void mqu_spill_push(struct mqu_spill *spill, struct mqu_spill_segment *segment)
+{
+	if (spill->last) spill->last->next = segment;
+	else spill->first = segment;
+	spill->last = segment;
+}
+
+static int mqu_spill_compare_seq(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+	return (x > y) - (x < y);
+}
+
+/* Load the segments left in the directory, oldest first */
+static int mqu_spill_recover(struct mqu_spill *spill)
+{
+	size_t baselen = strlen(spill->base);
+	unsigned long *seqs = NULL;
+	size_t count = 0;
+	size_t allocated = 0;
+	struct dirent *entry;
+	DIR *dir;
+
+	dir = opendir(spill->dir);
+	if (!dir) return -1;
+	while (NULL != (entry = readdir(dir))) {
+		const char *name = entry->d_name;
+		char *end;
+		if (0 != strncmp(name, spill->base, baselen) || '.' != name[baselen]) continue;
+		if (name[baselen + 1] < '0' || name[baselen + 1] > '9') continue;
+		unsigned long seq = strtoul(name + baselen + 1, &end, 10);
+		if (0 != strcmp(end, ".spill")) continue;
+		if (count == allocated) {
+			allocated = allocated ? 2 * allocated : 16;
+			unsigned long *grown = realloc(seqs, allocated * sizeof(*seqs));
+			if (!grown) {
+				free(seqs);
+				closedir(dir);
+				errno = ENOMEM;
+				return -1;
+			}
+			seqs = grown;
+		}
+		seqs[count++] = seq;
+	}
+	closedir(dir);
+
+	qsort(seqs, count, sizeof(*seqs), mqu_spill_compare_seq);
+	for (size_t i=0; i<count; i++) {
+		struct mqu_spill_segment *segment = mqu_spill_map(spill, seqs[i], 0);
+		if (!segment) {
+			free(seqs);
+			return -1;
+		}
+		struct mqu_spill_header *h = segment->header;
+		for (uint64_t off=h->read_off; off<h->write_off; ) {
+			const struct mqu_spill_record *record = (const void *)((uint8_t *)h + off);
+			/* a segment cut by a crash ends at its first record that does
+			 * not fit, which the drainer must not read past */
+			if ((off & 7) || h->write_off - off < sizeof(*record)
+			    || h->write_off - off < mqu_spill_record_size(record->len)) {
+				h->write_off = off;
+				break;
+			}
+			off += mqu_spill_record_size(record->len);
+			spill->pending++;
+		}
+		/* new messages go to a new segment */
+		h->sealed = 1;
+		mqu_spill_push(spill, segment);
+		spill->next_seq = seqs[i] + 1;
+	}
+	free(seqs);
+	return 0;
+}
+
+/* Send a message without waiting
+ *
+ * Return 0 if it was sent, 1 if the queue is full, -1 on error.
+ */
+static int mqu_spill_try_send(struct mqu_spill *spill, const void *data, size_t len, unsigned prio)
+{
+	/* a deadline in the past does not wait, whatever the O_NONBLOCK flag */
+	static const struct timespec now = { 0, 0 };
+
+	if (0 == mqu_send(spill->mqd, spill->stats, data, len, prio, &now)) return 0;
+	if (EAGAIN == errno || ETIMEDOUT == errno) return 1;
+	return -1;
+}
+
+static void *mqu_spill_drain(void *arg)
+{
+	struct mqu_spill *spill = arg;
+
+	pthread_mutex_lock(&spill->mutex);
+	while (spill->closing < 2) {
+		if (0 == spill->pending) {
+			if (spill->closing) break;
+			pthread_cond_wait(&spill->cond, &spill->mutex);
+			continue;
+		}
+
+		struct mqu_spill_segment *segment = spill->first;
+		struct mqu_spill_header *h = segment->header;
+		if (h->read_off == h->write_off) {
+			/* pending messages are in later segments, so this one is sealed */
+			spill->first = segment->next;
+			if (!spill->first) spill->last = NULL;
+			mqu_spill_unmap(spill, segment, 1);
+			continue;
+		}
+
+		/* the record does not move, and is only read here */
+		const struct mqu_spill_record *record = (const void *)((uint8_t *)h + h->read_off);
+		pthread_mutex_unlock(&spill->mutex);
+
+		int rv;
+		while (1 == (rv = mqu_spill_try_send(spill, record->data, record->len, record->prio))) {
+			struct pollfd pfd = { .fd = (int)spill->mqd, .events = POLLOUT };
+			poll(&pfd, 1, MQU_SPILL_POLL_MS);
+			pthread_mutex_lock(&spill->mutex);
+			int stop = (spill->closing >= 2);
+			pthread_mutex_unlock(&spill->mutex);
+			if (stop) break;
+		}
+
+		pthread_mutex_lock(&spill->mutex);
+		if (rv < 0) {
+			spill->error = errno;
+			break;
+		}
+		if (0 == rv) {
+			h->read_off += mqu_spill_record_size(record->len);
+			spill->pending--;
+			pthread_cond_broadcast(&spill->cond);
+		}
+	}
+	pthread_cond_broadcast(&spill->cond);
+	pthread_mutex_unlock(&spill->mutex);
+	return NULL;
+}
+
+struct mqu_spill *mqu_spill_open(const char *dir, const char *name, mqd_t mqd, struct mqu_stats *stats)
+{
+	char path[4096];
+	struct mq_attr attr;
+	struct mqu_spill *spill;
+
+	if ('/' != name[0] || !name[1] || strchr(name + 1, '/')) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (0 != mq_getattr(mqd, &attr)) return NULL;
+
+	spill = calloc(1, sizeof(*spill));
+	if (!spill) return NULL;
+	spill->dir = strdup(dir);
+	spill->base = strdup(name + 1);
+	spill->mqd = mqd;
+	spill->stats = stats;
+	spill->lock_fd = -1;
+	spill->segment_size = MQU_SPILL_SEGMENT;
+	if (spill->segment_size < sizeof(struct mqu_spill_header) + mqu_spill_record_size(attr.mq_msgsize)) {
+		spill->segment_size = sizeof(struct mqu_spill_header) + mqu_spill_record_size(attr.mq_msgsize);
+	}
+	if (!spill->dir || !spill->base) {
+		errno = ENOMEM;
+		goto error;
+	}
+
+	if (0 != mkdir(dir, 0755) && EEXIST != errno) goto error;
+
+	/* a single process may use the spill of a queue */
+	snprintf(path, sizeof(path), "%s/%s.lock", dir, spill->base);
+	spill->lock_fd = open(path, O_RDWR|O_CREAT, 0600);
+	if (spill->lock_fd < 0) goto error;
+	if (0 != flock(spill->lock_fd, LOCK_EX|LOCK_NB)) goto error;
+
+	if (0 != mqu_spill_recover(spill)) goto error;
+
+	pthread_mutex_init(&spill->mutex, NULL);
+	pthread_cond_init(&spill->cond, NULL);
+	errno = pthread_create(&spill->drainer, NULL, mqu_spill_drain, spill);
+	if (0 != errno) {
+		pthread_cond_destroy(&spill->cond);
+		pthread_mutex_destroy(&spill->mutex);
+		goto error;
+	}
+	return spill;
+
+error: {
+		int saved_errno = errno;
+		while (spill->first) {
+			struct mqu_spill_segment *next = spill->first->next;
+			mqu_spill_unmap(spill, spill->first, 0);
+			spill->first = next;
+		}
+		if (spill->lock_fd >= 0) close(spill->lock_fd);
+		free(spill->dir);
+		free(spill->base);
+		free(spill);
+		errno = saved_errno;
+		return NULL;
+	}
+}
+
+/* Append a message to the newest segment, with the mutex locked */
+static int mqu_spill_append(struct mqu_spill *spill, const void *data, size_t len, unsigned prio)
+{
+	size_t size = mqu_spill_record_size(len);
+	struct mqu_spill_segment *segment = spill->last;
+
+	if (sizeof(struct mqu_spill_header) + size > spill->segment_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (!segment || segment->header->sealed || segment->header->write_off + size > segment->header->size) {
+		struct mqu_spill_segment *next = mqu_spill_map(spill, spill->next_seq, 1);
+		if (!next) return -1;
+		spill->next_seq++;
+		if (segment) segment->header->sealed = 1;
+		mqu_spill_push(spill, next);
+		segment = next;
+	}
+
+	struct mqu_spill_header *h = segment->header;
+	struct mqu_spill_record *record = (void *)((uint8_t *)h + h->write_off);
+	record->len = len;
+	record->prio = prio;
+	memcpy(record->data, data, len);
+	h->write_off += size;
+	spill->pending++;
+	pthread_cond_broadcast(&spill->cond);
+	return 0;
+}
+
+int mqu_spill_send(struct mqu_spill *spill, const void *data, size_t len, unsigned prio)
+{
+	int rv;
+
+	pthread_mutex_lock(&spill->mutex);
+	if (spill->error) {
+		errno = spill->error;
+		rv = -1;
+	} else if (spill->pending) {
+		/* behind the spilled messages, to keep the order */
+		rv = mqu_spill_append(spill, data, len, prio);
+	} else {
+		/* the drainer only sends pending messages, so none is in flight */
+		pthread_mutex_unlock(&spill->mutex);
+		rv = mqu_spill_try_send(spill, data, len, prio);
+		if (rv <= 0) return rv;
+		pthread_mutex_lock(&spill->mutex);
+		rv = mqu_spill_append(spill, data, len, prio);
+	}
+	pthread_mutex_unlock(&spill->mutex);
+	return rv;
+}
+
+size_t mqu_spill_pending(struct mqu_spill *spill)
+{
+	pthread_mutex_lock(&spill->mutex);
+	size_t pending = spill->pending;
+	pthread_mutex_unlock(&spill->mutex);
+	return pending;
+}
+
+int mqu_spill_close(struct mqu_spill *spill, int drain)
+{
+	pthread_mutex_lock(&spill->mutex);
+	spill->closing = drain ? 1 : 2;
+	pthread_cond_broadcast(&spill->cond);
+	pthread_mutex_unlock(&spill->mutex);
+	pthread_join(spill->drainer, NULL);
+
+	int error = spill->error;
+	while (spill->first) {
+		struct mqu_spill_segment *next = spill->first->next;
+		struct mqu_spill_header *h = spill->first->header;
+		/* keep the segments that have messages, for the next spill */
+		int drained = (h->read_off == h->write_off);
+		if (!drained) msync(h, h->size, MS_SYNC);
+		mqu_spill_unmap(spill, spill->first, drained);
+		spill->first = next;
+	}
+	close(spill->lock_fd);
+	pthread_cond_destroy(&spill->cond);
+	pthread_mutex_destroy(&spill->mutex);
+	free(spill->dir);
+	free(spill->base);
+	free(spill);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
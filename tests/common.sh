@@ -0,0 +1,45 @@
+# Common code of the tests, sourced by each of them
+#
+# The tests run the mq of the build ($MQ, set by make check) on queues
+# of their own, $Q and $Q.2, created by mq_create. At exit they are
+# deleted, with both transports, along with the spill directory $SPILL
+# and the other files of $TMP. The tests are skipped (exit 77) without
+# /dev/mqueue.
+
+MQ=${MQ:-../src/mq}
+Q=/mq-test-$$
+
+if test ! -d /dev/mqueue; then
+	echo "/dev/mqueue is missing, skipping"
+	exit 77
+fi
+
+TMP=${TMPDIR:-/tmp}/mq-test-$$
+SPILL=$TMP/spill
+mkdir "$TMP" || exit 99
+
+cleanup() {
+	for queue in "$Q" "$Q.2"; do
+		"$MQ" unlink "$queue" 2>/dev/null
+		"$MQ" unlink --transport=shm "$queue" 2>/dev/null
+	done
+	rm -rf "$SPILL" "$TMP"
+}
+trap cleanup EXIT
+
+fail() {
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+mq_create() {
+	"$MQ" create "$@" || exit 99
+}
+
+# Compare the output of a command to the expected lines
+expect() {
+	expected=$1
+	shift
+	output=$("$@") || fail "$* exited with $?"
+	test "$expected" = "$output" || fail "$*: expected '$expected', got '$output'"
+}